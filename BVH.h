@@ -0,0 +1,374 @@
+#ifndef BVH_H
+#define BVH_H
+
+#ifndef VECTOR_H
+#define VECTOR_H
+#include <vector>
+#endif
+
+#ifndef ALGORITHM_H
+#define ALGORITHM_H
+#include <algorithm>
+#endif
+
+#ifndef CTIME_H
+#define CTIME_H
+#include <ctime>
+#endif
+
+#include <BoundingBox.h>
+
+// a bounding volume hierarchy built with the surface area heuristic (SAH).
+// it only knows about the bounding boxes of the primitives it is given, so the same code is used for triangles
+// in the raytracer - the primitive numbers it stores in 'indices' are the positions of the boxes passed to Build.
+
+// number of buckets the centroids are sorted into when looking for the best split
+const int BVH_BINS = 12;
+// a node with this many primitives or fewer may become a leaf
+const int BVH_MAX_LEAF_SIZE = 4;
+// relative cost of visiting a node and of testing a primitive, used by the surface area heuristic
+const float BVH_TRAVERSAL_COST = 1;
+const float BVH_INTERSECTION_COST = 2;
+// the deepest tree Traverse can walk - Build stops splitting before it gets this deep
+const int BVH_STACK_SIZE = 64;
+
+// the nodes are stored in one flat array - an interior node's children are next to each other at firstIndex and firstIndex + 1
+// for a leaf, its primitives are indices[firstIndex] ... indices[firstIndex + count - 1]
+struct BVHNode {
+  BoundingBox box;
+  int firstIndex;
+  int count; // number of primitives in a leaf, 0 for an interior node
+};
+
+class BVH {
+  public:
+    std::vector<BVHNode> nodes;
+    std::vector<int> indices; // primitive numbers in leaf order
+    int leafCount;
+    int depth;
+    double buildTime; // seconds
+    int groupSize; // how many primitives are tested at once (more than 1 when the leaves are tested with SIMD)
+
+    BVH() {
+      leafCount = 0;
+      depth = 0;
+      buildTime = 0;
+      groupSize = 1;
+    }
+
+    bool IsEmpty() const {
+      return nodes.empty();
+    }
+
+    // primitivesPerTest is how many of a leaf's primitives can be tested for the price of one - the SAH then
+    // prefers leaves that fill whole groups, and leaves are allowed to grow to at least that size
+    void Build(const std::vector<BoundingBox> &primitiveBoxes, int primitivesPerTest = 1) {
+      std::clock_t start = std::clock();
+      groupSize = primitivesPerTest;
+      nodes.clear();
+      indices.clear();
+      leafCount = 0;
+      depth = 0;
+
+      const int n = primitiveBoxes.size();
+      if (n > 0) {
+        std::vector<glm::vec3> centres(n);
+        for (int i = 0; i < n; i++) {
+          indices.push_back(i);
+          centres[i] = primitiveBoxes[i].GetCentre();
+        }
+        // a binary tree with n leaves has 2n - 1 nodes
+        nodes.reserve((2 * n) - 1);
+        BVHNode root;
+        root.firstIndex = 0;
+        root.count = n;
+        nodes.push_back(root);
+        Subdivide(0, primitiveBoxes, centres, 1);
+      }
+      buildTime = (std::clock() - start) / (double) CLOCKS_PER_SEC;
+    }
+
+    // the expected cost of tracing a random ray through the tree (relative to testing every primitive, which costs n * BVH_INTERSECTION_COST)
+    float Cost() const {
+      if (nodes.empty()) return 0;
+      const float rootArea = nodes[0].box.SurfaceArea();
+      if (rootArea <= 0) return 0;
+      float cost = 0;
+      for (int i = 0; i < (int)nodes.size(); i++) {
+        const float p = nodes[i].box.SurfaceArea() / rootArea; // chance of a ray that hits the root also hitting this node
+        if (nodes[i].count > 0) cost += p * TestCount(nodes[i].count) * BVH_INTERSECTION_COST;
+        else cost += p * BVH_TRAVERSAL_COST;
+      }
+      return cost;
+    }
+
+    // updates the boxes for primitives that have moved, keeping the same tree shape - much cheaper than Build, but the
+    // tree gets looser the further the primitives move from where they were when it was built (compare Cost() to see how much)
+    // primitiveBoxes must have the same size as when the tree was built
+    void Refit(const std::vector<BoundingBox> &primitiveBoxes) {
+      // children are always stored after their parent, so going backwards updates both children before the parent
+      for (int i = nodes.size() - 1; i >= 0; i--) {
+        BVHNode &node = nodes[i];
+        BoundingBox box;
+        if (node.count > 0) {
+          for (int j = node.firstIndex; j < node.firstIndex + node.count; j++) box.Expand(primitiveBoxes[indices[j]]);
+        }
+        else {
+          box.Expand(nodes[node.firstIndex].box);
+          box.Expand(nodes[node.firstIndex + 1].box);
+        }
+        node.box = box;
+      }
+    }
+
+    // walks the tree front to back, calling leaf(firstIndex, count) for every leaf whose box the ray enters before maxT
+    // (the leaf's primitives are indices[firstIndex] ... indices[firstIndex + count - 1])
+    // the leaf function can shrink maxT when it finds a closer hit, and can return true to stop the walk straight away
+    // nodesVisited is increased by the number of boxes tested
+    template <typename LeafFunction>
+    void Traverse(glm::vec3 origin, glm::vec3 inverseDirection, float &maxT, long &nodesVisited, LeafFunction leaf) const {
+      if (nodes.empty()) return;
+
+      // each stack entry is a node along with the distance at which the ray enters its box
+      // we push at most one more entry than we pop on each level, so the stack can't be deeper than the tree
+      int nodeStack[BVH_STACK_SIZE];
+      float nearStack[BVH_STACK_SIZE];
+      int stackSize = 0;
+
+      float tNear;
+      nodesVisited++;
+      if (nodes[0].box.Intersects(origin, inverseDirection, 0, maxT, tNear)) {
+        nodeStack[0] = 0;
+        nearStack[0] = tNear;
+        stackSize = 1;
+      }
+
+      while (stackSize > 0) {
+        stackSize--;
+        // we might have found something closer since this node was pushed
+        if (nearStack[stackSize] > maxT) continue;
+        const BVHNode &node = nodes[nodeStack[stackSize]];
+
+        if (node.count > 0) {
+          if (leaf(node.firstIndex, node.count)) return;
+        }
+        else {
+          // test both children and visit the nearer one first, as a close hit there lets us skip the other
+          const int left = node.firstIndex;
+          float tLeft, tRight;
+          nodesVisited += 2;
+          const bool hitLeft = nodes[left].box.Intersects(origin, inverseDirection, 0, maxT, tLeft);
+          const bool hitRight = nodes[left + 1].box.Intersects(origin, inverseDirection, 0, maxT, tRight);
+          if (hitLeft && hitRight) {
+            const bool leftFirst = (tLeft <= tRight);
+            nodeStack[stackSize] = leftFirst ? left + 1 : left;
+            nearStack[stackSize] = leftFirst ? tRight : tLeft;
+            nodeStack[stackSize + 1] = leftFirst ? left : left + 1;
+            nearStack[stackSize + 1] = leftFirst ? tLeft : tRight;
+            stackSize += 2;
+          }
+          else if (hitLeft || hitRight) {
+            nodeStack[stackSize] = hitLeft ? left : left + 1;
+            nearStack[stackSize] = hitLeft ? tLeft : tRight;
+            stackSize++;
+          }
+        }
+      }
+    }
+
+    // the same walk for a packet of rays that share an origin and point into the same octant - the boxes are tested
+    // once for the whole packet with BoundingBox::IntersectsInterval, so a node is only skipped when every ray misses it.
+    // maxT is the furthest any ray in the packet still needs to look (the largest of their closest hits so far)
+    template <typename LeafFunction>
+    void TraversePacket(glm::vec3 origin, glm::vec3 inverseMin, glm::vec3 inverseMax, float &maxT, long &nodesVisited, LeafFunction leaf) const {
+      if (nodes.empty()) return;
+
+      int nodeStack[BVH_STACK_SIZE];
+      float nearStack[BVH_STACK_SIZE];
+      int stackSize = 0;
+
+      float tNear;
+      nodesVisited++;
+      if (nodes[0].box.IntersectsInterval(origin, inverseMin, inverseMax, 0, maxT, tNear)) {
+        nodeStack[0] = 0;
+        nearStack[0] = tNear;
+        stackSize = 1;
+      }
+
+      while (stackSize > 0) {
+        stackSize--;
+        if (nearStack[stackSize] > maxT) continue;
+        const BVHNode &node = nodes[nodeStack[stackSize]];
+
+        if (node.count > 0) {
+          if (leaf(node.firstIndex, node.count)) return;
+        }
+        else {
+          const int left = node.firstIndex;
+          float tLeft, tRight;
+          nodesVisited += 2;
+          const bool hitLeft = nodes[left].box.IntersectsInterval(origin, inverseMin, inverseMax, 0, maxT, tLeft);
+          const bool hitRight = nodes[left + 1].box.IntersectsInterval(origin, inverseMin, inverseMax, 0, maxT, tRight);
+          if (hitLeft && hitRight) {
+            const bool leftFirst = (tLeft <= tRight);
+            nodeStack[stackSize] = leftFirst ? left + 1 : left;
+            nearStack[stackSize] = leftFirst ? tRight : tLeft;
+            nodeStack[stackSize + 1] = leftFirst ? left : left + 1;
+            nearStack[stackSize + 1] = leftFirst ? tLeft : tRight;
+            stackSize += 2;
+          }
+          else if (hitLeft || hitRight) {
+            nodeStack[stackSize] = hitLeft ? left : left + 1;
+            nearStack[stackSize] = hitLeft ? tLeft : tRight;
+            stackSize++;
+          }
+        }
+      }
+    }
+
+    // calls leaf(firstIndex, count) for every leaf whose box contains point, for trees of things that reach over a
+    // region (like the lights) rather than things rays hit. the leaf function can return true to stop the walk
+    template <typename LeafFunction>
+    void TraversePoint(glm::vec3 point, long &nodesVisited, LeafFunction leaf) const {
+      if (nodes.empty()) return;
+
+      // both children can be pushed on each level, so the stack is at most one deeper than the tree
+      int nodeStack[BVH_STACK_SIZE + 1];
+      int stackSize = 0;
+      nodesVisited++;
+      if (nodes[0].box.Contains(point)) nodeStack[stackSize++] = 0;
+
+      while (stackSize > 0) {
+        const BVHNode &node = nodes[nodeStack[--stackSize]];
+        if (node.count > 0) {
+          if (leaf(node.firstIndex, node.count)) return;
+        }
+        else {
+          const int left = node.firstIndex;
+          nodesVisited += 2;
+          if (nodes[left].box.Contains(point)) nodeStack[stackSize++] = left;
+          if (nodes[left + 1].box.Contains(point)) nodeStack[stackSize++] = left + 1;
+        }
+      }
+    }
+
+  private:
+    // the number of tests it takes to check n primitives
+    float TestCount(int n) const {
+      return float((n + groupSize - 1) / groupSize);
+    }
+
+    void Subdivide(int nodeIndex, const std::vector<BoundingBox> &boxes, const std::vector<glm::vec3> &centres, int level) {
+      const int first = nodes[nodeIndex].firstIndex;
+      const int count = nodes[nodeIndex].count;
+      if (level > depth) depth = level;
+
+      // bounds of the primitives and of their centres
+      BoundingBox box, centreBox;
+      for (int i = first; i < first + count; i++) {
+        box.Expand(boxes[indices[i]]);
+        centreBox.Expand(centres[indices[i]]);
+      }
+      nodes[nodeIndex].box = box;
+
+      if ((count == 1) || (level == BVH_STACK_SIZE)) {
+        leafCount++;
+        return;
+      }
+
+      // sort the centres into buckets along each axis and find the split plane with the lowest SAH cost
+      float bestCost = std::numeric_limits<float>::infinity();
+      int bestAxis = -1;
+      int bestSplit = 0;
+      const glm::vec3 extent = centreBox.GetSize();
+      for (int axis = 0; axis < 3; axis++) {
+        if (extent[axis] <= 0) continue;
+        int binCounts[BVH_BINS] = {0};
+        BoundingBox binBoxes[BVH_BINS];
+        const float scale = BVH_BINS / extent[axis];
+        for (int i = first; i < first + count; i++) {
+          const int p = indices[i];
+          const int bin = std::min(BVH_BINS - 1, int((centres[p][axis] - centreBox.min[axis]) * scale));
+          binCounts[bin]++;
+          binBoxes[bin].Expand(boxes[p]);
+        }
+        // sweep from the left and then from the right to get the area and count on each side of every plane
+        float leftAreas[BVH_BINS - 1];
+        int leftCounts[BVH_BINS - 1];
+        BoundingBox sweep;
+        int sweepCount = 0;
+        for (int b = 0; b < BVH_BINS - 1; b++) {
+          sweep.Expand(binBoxes[b]);
+          sweepCount += binCounts[b];
+          leftAreas[b] = sweep.SurfaceArea();
+          leftCounts[b] = sweepCount;
+        }
+        sweep = BoundingBox();
+        sweepCount = 0;
+        for (int b = BVH_BINS - 1; b > 0; b--) {
+          sweep.Expand(binBoxes[b]);
+          sweepCount += binCounts[b];
+          if ((leftCounts[b - 1] == 0) || (sweepCount == 0)) continue;
+          const float cost = (leftAreas[b - 1] * TestCount(leftCounts[b - 1])) + (sweep.SurfaceArea() * TestCount(sweepCount));
+          if (cost < bestCost) {
+            bestCost = cost;
+            bestAxis = axis;
+            bestSplit = b;
+          }
+        }
+      }
+
+      const float area = box.SurfaceArea();
+      const float leafCost = TestCount(count) * BVH_INTERSECTION_COST;
+      const int maxLeafSize = std::max(BVH_MAX_LEAF_SIZE, groupSize);
+      const float splitCost = (area > 0) ? BVH_TRAVERSAL_COST + (BVH_INTERSECTION_COST * bestCost / area) : leafCost;
+
+      int middle;
+      if (bestAxis == -1) {
+        // all the centres are in the same place, so no plane can separate them
+        if (count <= maxLeafSize) {
+          leafCount++;
+          return;
+        }
+        middle = first + (count / 2);
+      }
+      else {
+        if ((count <= maxLeafSize) && (leafCost <= splitCost)) {
+          leafCount++;
+          return;
+        }
+        const float scale = BVH_BINS / extent[bestAxis];
+        int *middlePointer = std::partition(&indices[first], &indices[first] + count, [&](int p) {
+          return std::min(BVH_BINS - 1, int((centres[p][bestAxis] - centreBox.min[bestAxis]) * scale)) < bestSplit;
+        });
+        middle = middlePointer - &indices[0];
+      }
+
+      // create the two children next to each other
+      const int leftIndex = nodes.size();
+      BVHNode left, right;
+      left.firstIndex = first;
+      left.count = middle - first;
+      right.firstIndex = middle;
+      right.count = first + count - middle;
+      nodes.push_back(left);
+      nodes.push_back(right);
+      nodes[nodeIndex].firstIndex = leftIndex;
+      nodes[nodeIndex].count = 0;
+
+      Subdivide(leftIndex, boxes, centres, level + 1);
+      Subdivide(leftIndex + 1, boxes, centres, level + 1);
+    }
+};
+
+// the slab test needs 1/direction - an axis-aligned ray would divide by zero, so push zero components to a tiny value instead
+glm::vec3 inverseRayDirection(glm::vec3 direction) {
+  glm::vec3 inverse;
+  for (int i = 0; i < 3; i++) {
+    const float d = (std::abs(direction[i]) < 1e-20f) ? ((direction[i] < 0) ? -1e-20f : 1e-20f) : direction[i];
+    inverse[i] = 1 / d;
+  }
+  return inverse;
+}
+
+#endif
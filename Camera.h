@@ -0,0 +1,107 @@
+#ifndef CAMERA_H
+#define CAMERA_H
+
+#include <glm/glm.hpp>
+
+// the row generator uses SSE where the compiler has it (every x86-64 compiler does) - everything else does a ray at a time
+#if defined(__SSE2__)
+#define CAMERA_SSE
+#include <immintrin.h>
+#endif
+
+// the camera for one raytraced frame, which gives the direction of the ray through any point of the image.
+// everything that is the same for every ray is worked out once in Set, so a ray is just
+// corner + (x * stepX) + (y * stepY), normalised. points on the image are measured in samples - sample (i,j) covers
+// x from i to i + 1 and y from j to j + 1, and its ray goes through the middle of it
+class Camera {
+  public:
+    glm::vec3 position;
+    glm::vec3 right;
+    glm::vec3 up;
+    glm::vec3 forward; // this is actually backwards, like cameraForward
+    float focalLength;
+    glm::vec2 sampleSize; // how big a sample is on the image plane
+    int width; // the size of the image in samples
+    int height;
+
+    Camera() {
+      Set(glm::vec3(0, 0, 0), glm::vec3(1, 0, 0), glm::vec3(0, 1, 0), glm::vec3(0, 0, 1), 1, glm::vec2(1, 1), 1, 1);
+    }
+
+    // the image plane is focalLength in front of the camera, with its centre straight ahead
+    void Set(glm::vec3 cameraPosition, glm::vec3 cameraRight, glm::vec3 cameraUp, glm::vec3 cameraForward, float cameraFocalLength, glm::vec2 imageSampleSize, int imageWidth, int imageHeight) {
+      position = cameraPosition;
+      right = cameraRight;
+      up = cameraUp;
+      forward = cameraForward;
+      focalLength = cameraFocalLength;
+      sampleSize = imageSampleSize;
+      width = imageWidth;
+      height = imageHeight;
+
+      // the ray through the top left corner of the image, before it is normalised (the image centre is width/2, like createRay had it)
+      corner = (-focalLength * forward) - (sampleSize.x * float(width / 2) * right) + (sampleSize.y * float(height / 2) * up);
+      stepX = sampleSize.x * right;
+      stepY = -sampleSize.y * up;
+    }
+
+    // true if both cameras would give the same rays
+    bool SameView(const Camera &other) const {
+      return (position == other.position) && (right == other.right) && (up == other.up) && (forward == other.forward) &&
+             (focalLength == other.focalLength) && (sampleSize == other.sampleSize) && (width == other.width) && (height == other.height);
+    }
+
+    // the ray through point (x,y) of the image
+    glm::vec3 Direction(float x, float y) const {
+      return glm::normalize((corner + (y * stepY)) + (x * stepX));
+    }
+
+    // the ray through the middle of sample (i,j)
+    glm::vec3 Direction(int i, int j) const {
+      return Direction(float(i) + 0.5f, float(j) + 0.5f);
+    }
+
+    // fills in the rays through the middles of samples (i,j), (i + stride, j), ... - count of them in all
+    void RowDirections(int i, int j, int count, glm::vec3 *directions, int stride = 1) const {
+      int n = 0;
+#ifdef CAMERA_SSE
+      const glm::vec3 rowCorner = corner + ((float(j) + 0.5f) * stepY);
+      const __m128 cornerX = _mm_set1_ps(rowCorner.x), cornerY = _mm_set1_ps(rowCorner.y), cornerZ = _mm_set1_ps(rowCorner.z);
+      const __m128 stepXX = _mm_set1_ps(stepX.x), stepXY = _mm_set1_ps(stepX.y), stepXZ = _mm_set1_ps(stepX.z);
+      const __m128 one = _mm_set1_ps(1);
+      const __m128 lanes = _mm_set_ps(3 * stride, 2 * stride, stride, 0);
+      for (; n + 4 <= count; n += 4) {
+        const __m128 x = _mm_add_ps(_mm_set1_ps(float(i + (n * stride)) + 0.5f), lanes);
+        const __m128 dx = _mm_add_ps(cornerX, _mm_mul_ps(x, stepXX));
+        const __m128 dy = _mm_add_ps(cornerY, _mm_mul_ps(x, stepXY));
+        const __m128 dz = _mm_add_ps(cornerZ, _mm_mul_ps(x, stepXZ));
+        const __m128 lengthSquared = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+        const __m128 inverseLength = _mm_div_ps(one, _mm_sqrt_ps(lengthSquared));
+        float x4[4], y4[4], z4[4];
+        _mm_storeu_ps(x4, _mm_mul_ps(dx, inverseLength));
+        _mm_storeu_ps(y4, _mm_mul_ps(dy, inverseLength));
+        _mm_storeu_ps(z4, _mm_mul_ps(dz, inverseLength));
+        for (int lane = 0; lane < 4; lane++) directions[n + lane] = glm::vec3(x4[lane], y4[lane], z4[lane]);
+      }
+#endif
+      for (; n < count; n++) directions[n] = Direction(i + (n * stride), j);
+    }
+
+    // where point is on the image (the opposite of Direction) - returns false if it is behind the camera
+    bool Project(glm::vec3 point, glm::vec2 &sample) const {
+      const glm::vec3 d = point - position;
+      const float depth = -glm::dot(d, forward);
+      if (depth < 0.001f) return false;
+      const float horizontalDistance = focalLength * glm::dot(d, right) / depth;
+      const float verticalDistance = -focalLength * glm::dot(d, up) / depth;
+      sample = glm::vec2((horizontalDistance / sampleSize.x) + float(width / 2), (verticalDistance / sampleSize.y) + float(height / 2));
+      return true;
+    }
+
+  private:
+    glm::vec3 corner;
+    glm::vec3 stepX;
+    glm::vec3 stepY;
+};
+
+#endif
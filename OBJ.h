@@ -16,6 +16,9 @@
 #include <fstream>
 #endif
 
+#include <map>
+#include <memory>
+
 #ifndef MODELTRIANGLE_H
   #define MODELTRIANGLE_H
   #include <ModelTriangle.h>
@@ -150,6 +153,7 @@ vector<Object> readGroupedOBJ(std::string objFileName, std::string mtlFileName,
   int i_faces = 0;
   int i_group = 0; // 0 based index.
   bool hasGroup = false;
+  vector<string> groupNames;
   while (getline(myfile, line)){ 
     if (line.find("usemtl") == 0){ 
       vector<string> colourVector = separateLine(line); 
@@ -164,6 +168,10 @@ vector<Object> readGroupedOBJ(std::string objFileName, std::string mtlFileName,
     else if (line.find('g') == 0) {
       i_group++;
       hasGroup = true;
+      vector<string> groupLine = separateLine(line); // this turns 'g light' into ['g','light']
+      string name = (groupLine.size() > 1) ? groupLine[1] : "";
+      if (!name.empty() && (name[name.length() - 1] == '\r')) name.erase(name.length() - 1);
+      groupNames.push_back(name);
     }
     else if (line.find("vt") == 0) {
       verticesTextures.push_back(getVertexTexture(line));
@@ -235,7 +243,20 @@ vector<Object> readGroupedOBJ(std::string objFileName, std::string mtlFileName,
     perObjectFaceIndex[objectIndex]++;
     outputList[objectIndex].faces.push_back(face);
   }
+  for (int i = 0; i < groupSize; i++) {
+    if (hasGroup) outputList[i].name = groupNames[i];
+    outputList[i].MarkChanged();
+  }
   //At this point we have i_group GROUPS.
   return outputList;
 }
+
+// the first group of an OBJ file as a mesh for instances to share (see Mesh.h) - each file is only read the first time
+// it is asked for, so every copy of the logo is made from the same faces
+shared_ptr<const Mesh> readOBJMesh(std::string objFileName, std::string mtlFileName, float scalingFactor) {
+  static map<string, shared_ptr<const Mesh>> meshes;
+  shared_ptr<const Mesh> &mesh = meshes[objFileName + " " + mtlFileName + " " + to_string(scalingFactor)];
+  if (!mesh) mesh = make_shared<const Mesh>(readGroupedOBJ(objFileName, mtlFileName, scalingFactor).at(0).faces);
+  return mesh;
+}
 #endif
\ No newline at end of file
@@ -5,9 +5,21 @@
 #include "PPM.h"
 #include "Materials.h"
 #include "Interpolate.h"
+#include "BVH.h"
+#include "TriangleBlock.h"
+#include "ThreadPool.h"
+#include "Camera.h"
 
 #include <Utils.h> 
 #include <RayTriangleIntersection.h> 
+#include <RayHit.h>
+#include <Light.h>
+
+#include <atomic>
+#include <cstring>
+#include <map>
+#include <new>
+#include <set>
  
 using namespace std; 
 using namespace glm;
@@ -32,14 +44,41 @@ RENDERTYPE currentRender = WIREFRAME; //Set default RenderType here.
 std::string defaultPPMFileName = "render/snapshot";
 
 const int maximumNumberOfReflections = 7;
+float minimumRayWeight = 0.01; //Reflected and refracted rays that would add less than this much to their pixel's colour (1 is all of it) are not traced.
+int softShadowGrid = 4; //Set the soft shadows to take softShadowGrid x softShadowGrid samples of the area light here.
+bool adaptiveSoftShadows = true; //Stop sampling the area light after the four corner samples when they all agree.
+bool softShadowsFromLitPoints = true; //Sample an area light from the points that can see its middle as well, so soft shadows get the outer half of their edge (turn off to save the corner samples on lit points).
+float lightCullThreshold = 0.01; //Leave a light (and its shadow rays) out of the shading at points where it would add less than this much diffuse light.
+bool useOccluderCache = true; //Test each shadow ray against the face that last blocked a shadow ray to the same light (in the same tile) before searching the whole scene.
+bool useRussianRoulette = false; //Instead of dropping every ray under minimumRayWeight, trace some of them at random and count those for more, which keeps the average colour right.
 
 #define W 576 //Set desired screen width here. 
 #define H 600 //Set desired screen height here.
 
 const int AA = 2; //Set Anti-Aliasing Multiplier here, applied to both x and y so expect ~AA^2 time [eg. 800x800x1 5.43s, 800x800x4 88.7s ~16.4x]
+bool useAdaptiveAA = true; //Raytrace one sample per pixel, and only take all AA x AA samples for pixels that look different to a neighbour (an edge).
+int adaptiveAAColourThreshold = 16; //Neighbouring pixels whose red, green or blue differ by more than this (out of 255) are supersampled.
+float adaptiveAADepthThreshold = 0.05; //So are neighbours whose distances from the camera differ by more than this fraction (or that hit different objects or materials).
+bool jitterAASamples = false; //Put the extra samples adaptive AA takes at a random spot inside each AA x AA cell of the pixel, instead of the middle of it.
+bool showSamplesPerPixel = false; //Show how many samples adaptive AA took for each pixel instead of the image (white is AA x AA, dark grey is 1).
 
 bool displayRenderTime = false;
 
+bool useBVH = true; //Set to false to test every face for every ray instead of using the bounding volume hierarchy.
+bool displayBVHStats = false; //Print the BVH build and traversal statistics after every raytraced frame.
+bool usePacketTracing = true; //Trace the camera rays in 8x8 packets that walk the BVH together (only used with the BVH).
+bool useWavefront = false; //Trace each tile a bounce at a time, with every bounce's rays sorted by direction and position and their hits shaded grouped by material.
+
+bool useDirtyRegions = true; //When the camera and light stay put, only retrace the parts of the screen that the objects which changed (and their shadows and reflections) could cover.
+int dirtyRegionMargin = 2; //Retrace this many more pixels around every changed part of the screen.
+bool useTemporalReprojection = true; //When the camera moves between raytraced frames, reuse the colours of the last frame for the points both cameras can see (that don't look different from the new angle).
+float temporalDepthThreshold = 0.02; //A point is only reused if it is within this fraction of its distance from the last camera of where the last frame saw it.
+int temporalMaxAge = 4; //A pixel's colour is worked out again after being reused this many frames in a row, so small errors can't build up.
+bool useProgressiveRefinement = true; //When the camera moves in raytrace mode, show a coarse image straight away and sharpen it a pass at a time while there is no new input.
+
+int numberOfThreads = 0; //Set the number of threads the raytracer renders with here (0 uses one for each core).
+bool displayThreadStats = false; //Print how many tiles each raytracing thread rendered and how busy it was after every raytraced frame.
+
 //Scene we want to render.
 string objFileName = "cornell-box.obj"; 
 string mtlFileName = "cornell-box.mtl"; 
@@ -53,9 +92,28 @@ string texFileName = "texture.ppm";
 const int WIDTH = W * AA;
 const int HEIGHT = H * AA;
 
+// camera rays are traced in square packets of PACKET_WIDTH x PACKET_WIDTH pixels
+const int PACKET_WIDTH = 8;
+const int PACKET_SIZE = PACKET_WIDTH * PACKET_WIDTH;
+// the raytraced image is split into square tiles of TILE_SIZE x TILE_SIZE pixels (a multiple of PACKET_WIDTH) which are rendered in parallel
+const int TILE_SIZE = 32;
+const int TILES_ACROSS = (WIDTH + TILE_SIZE - 1) / TILE_SIZE;
+const int TILES_DOWN = (HEIGHT + TILE_SIZE - 1) / TILE_SIZE;
+// the progressive render traces one sample per 8x8, 4x4 and 2x2 block of screen pixels, then one per pixel, then the
+// rest of the anti-aliasing samples (which it can skip if AA is 1)
+const int PROGRESSIVE_PASSES = (AA > 1) ? 5 : 4;
+
 vector<uint32_t> pixelBuffer; 
 vector<float> depthMap;
   
+struct RayStack;
+struct RayTask;
+struct WavefrontBuffers;
+struct ScreenRect;
+struct RaytracedFrame;
+struct ObjectBVH;
+struct ObjectRay;
+
 void handleEvent(SDL_Event event);
 void render(); 
 void clear(); 
@@ -69,24 +127,72 @@ void renderImageFile(ImageFile imageFile);
 void lookAt(vec3 point); 
 vec3 findCentreOfScene(); 
 void raytracer(); 
-Colour solveLight(RayTriangleIntersection closest, vec3 rayDirection, float Ka, float Kd, float Ks); 
-vec3 createRay(const int i, const int j); 
-vector<vector<vec4>> checkForIntersections(vec3 point, vec3 rayDirection);
-vector<vec4> faceIntersections(vector<ModelTriangle> inputFaces, vec3 point, vec3 rayDirection);
-RayTriangleIntersection closestIntersection(vector<vector<vec4>> solutions, vec3 rayPoint); 
+void raytraceTiles(int firstTile, int tileCount, std::function<void(int, int)> renderTileAt, const vector<bool> *onlyTiles = NULL);
+void renderTile(int x, int y);
+void startProgressiveRender();
+bool refineProgressiveRender();
+void exportRecordedFrame();
+void stopProgressiveRender();
+int progressiveStep(int pass);
+void renderTileSamples(int x, int y, int step, int previousStep);
+void tracePixelSample(int i, int j, bool reuseLastFrame = false);
+void finishPixelSample(int i, int j, const RayHit &hit, vec3 rayDirection, bool reuseLastFrame);
+void renderTilePixelSamples(int x, int y, bool reuseLastFrame);
+void tracePixelSamplePacket(int x, int y, int xEnd, int yEnd, bool reuseLastFrame);
+void markAdaptivePixels();
+void renderTileAdaptive(int x, int y);
+bool differentPixels(int a, int b);
+int findDirtyTiles(vector<bool> &dirtyTiles);
+bool findChangedRegion(ScreenRect &region);
+bool prepareReprojection();
+bool reprojectedColour(int i, int j, const RayHit &hit, const RayTriangleIntersection &closest, vec3 rayDirection, uint32_t &colour);
+void recordRaytracedFrame();
+void forgetRaytracedFrame();
+bool hasMaterial(const Object &object, MATERIAL material);
+float distanceToLeaveScene(vec3 point, vec3 direction);
+void fillProgressiveBlocks(int step);
+void showPixelBuffer();
+void printThreadStats();
+Colour solveLight(const RayTriangleIntersection &closest, vec3 rayDirection, float Ka, float Kd, float Ks); 
+bool closestHit(vec3 rayPoint, vec3 rayDirection, RayHit &hit);
+void closestHitPacket(vec3 rayPoint, const vec3 *rayDirections, int count, RayHit *hits);
+bool sameOctant(const vec3 *directions, int count);
+void tracePrimaryPacket(int x, int y);
+RayTriangleIntersection closestIntersection(vec3 rayPoint, vec3 rayDirection);
+RayTriangleIntersection createIntersection(int objectIndex, int faceIndex, float u, float v, vec3 rayPoint);
+const ModelTriangle &hitTriangle(const RayTriangleIntersection &intersection);
+void prepareRaytracer();
+void buildSceneBVH();
+void buildTriangleBlocks(ObjectBVH &objectBVH, const vector<TriangleRecord> &records);
+ObjectRay objectSpaceRay(int o, vec3 rayPoint, vec3 rayDirection, vec3 inverseDirection);
+void closestHitInObject(int o, const ObjectRay &ray, float &closestT, RayHit &hit);
+void benchmarkRays();
+void printBVHStats();
 Colour shootRay(vec3 rayPoint, vec3 rayDirection, int depth, float currentIOR); 
-Colour getFinalColour(Colour colour, float Ka, float Kd, float Ks); 
-float intensityDropOff(const vec3 point); 
-float angleOfIncidence(RayTriangleIntersection intersection); 
+Colour shadeIntersection(const RayTriangleIntersection &closest, vec3 rayDirection, int depth, float currentIOR);
+void addRayColour(const RayTriangleIntersection &closest, vec3 rayDirection, int depth, float currentIOR, float weight, RayStack &rays, vec3 &total);
+Colour surfaceColour(const RayTriangleIntersection &closest, vec3 rayDirection);
+float rayRandom(const RayTask &ray);
+float hashRandom(vec3 a, vec3 b);
+bool keepRay(RayTask &ray);
+void renderTileWavefront(int x, int y);
+void traceWave(WavefrontBuffers &buffers);
+void shadeWave(WavefrontBuffers &buffers);
+Colour getFinalColour(const Colour &colour, float Ka, float Kd, float Ks); 
+float intensityDropOff(const vec3 point, const Light &light); 
+float angleOfIncidence(const RayTriangleIntersection &intersection, const Light &light); 
 float distanceVec3(vec3 from, vec3 to); 
-SHADOW InShadow(vec3 point); 
-float calculateSpecularLight(vec3 point, vec3 rayDirection, vec3 normal);
-float softShadows(RayTriangleIntersection intersection);
-Colour mirror(RayTriangleIntersection intersection, vec3 incident);
-Colour glass(vec3 rayDirection, RayTriangleIntersection closest, int depth);
+SHADOW InShadow(vec3 point, int light); 
+SHADOW occlusion(vec3 point, vec3 target, int light);
+float calculateSpecularLight(vec3 point, vec3 rayDirection, vec3 normal, const Light &light);
+float softShadows(const RayTriangleIntersection &intersection, int light);
+vec3 areaLightSample(vec3 point, int cell, int grid, const Light &light);
+void loadLights();
+void buildLightBVH();
+template <typename LightFunction> void forEachLightAt(vec3 point, bool countStats, LightFunction lightFunction);
+void glass(vec3 rayDirection, const RayTriangleIntersection &closest, int depth, float weight, RayStack &rays);
 vec4 refract(vec3 I, vec3 N, float ior);
 float fresnel(vec3 incident, vec3 normal, float ior);
-void backfaceCulling(vec3 rayDirection);
 void spin(vec3 point, float angle, float distance);
 void spinAround(float angle, int stepNumber, bool clockwise, int zoom);
 void spinAroundAndSpinSubObject(float angle, int stepNumber, bool clockwise, int zoom, int subObjectIndex, float subObjectRotation);
@@ -121,8 +227,9 @@ float imageWidth = 2; // WIDTH
 float imageHeight = imageWidth * (HEIGHT / float(WIDTH)); // HEIGHT 
 
 // light parameters 
-vec3 lightPosition (-0.234011, 5, -3); // this is roughly the centre of the white light box 
-float lightIntensity = 100; 
+// the lights the raytracer shades with, which loadLights finds in the scene (light 0 is the white light box)
+vector<Light> lights;
+float lightIntensity = 100; // how bright the lights from the scene start off
 
 const float pi = 3.14159265358979323846;
 
@@ -155,6 +262,7 @@ glm::vec3 GetSceneXCentre() {
 void resetToOriginalScene() {
   textureFile = importPPM(texFileName);
   objects = readGroupedOBJ(objFileName, mtlFileName, 1);
+  loadLights();
   objects.at(4).ApplyMaterial(MIRROR); // Mirrored floor
   objects.at(6).ApplyMaterial(GLASS);  // Mirrored Red Box.
   cameraPosition[0] = GetSceneXCentre()[0]; 
@@ -170,6 +278,8 @@ int main(int argc, char* argv[]) {
   while(true) { 
     // We MUST poll for events - otherwise the window will freeze ! 
     if(window.pollForInputEvents(&event)) handleEvent(event);
+    // while there is no input, carry on sharpening the raytraced image (if a camera move started a progressive render)
+    else refineProgressiveRender();
  
     // Need to render the frame at the end, or nothing actually gets shown on the screen ! 
     window.renderFrame(); 
@@ -190,10 +300,13 @@ void SetBufferColour(int x, int y, uint32_t col) {
 
 // this function renders the scene, depending on what the value of STATE is (so whether we use wireframe, rasterize or raytrace) 
 void render(){
-  clear();
+  // a full render replaces whatever the progressive render was working on
+  stopProgressiveRender();
+  // the raytracer colours in every pixel itself, and keeps the parts of the last frame that haven't changed
+  if (currentRender != RAYTRACE) clear();
 
-  //Initialise Timer.
-  std::clock_t start = std::clock();
+  //Initialise Timer (wall clock time, as std::clock would add up the time of every raytracing thread).
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
 
   switch (currentRender) {
     case RAYTRACE:
@@ -207,7 +320,22 @@ void render(){
       break;
   }
 
-  /* pixelBuffer ---> Display, iif AAMultiplier is greater than 1.*/
+  showPixelBuffer();
+  window.renderFrame(); 
+  double duration = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  if (displayRenderTime) cout << "Time Taken To Render: " << duration << "\n";
+  exportRecordedFrame();
+} 
+
+// while recording, saves what is on the screen as the next frame
+void exportRecordedFrame(){
+  if (!recording) return;
+  exportToPPM(defaultPPMFileName + std::to_string(currentFrame) + ".ppm", CreateImageFileFromWindow(window, W, H)); 
+  currentFrame++;
+}
+
+/* pixelBuffer ---> Display, iif AAMultiplier is greater than 1.*/
+void showPixelBuffer(){
   if (AA > 1) {
     for (int j=0; j<HEIGHT; j+=AA) {
       for (int i=0; i<WIDTH; i+=AA) {
@@ -231,14 +359,7 @@ void render(){
       }
     }
   }
-  window.renderFrame(); 
-  double duration = ( std::clock() - start ) / (double) CLOCKS_PER_SEC;
-  if (displayRenderTime) cout << "Time Taken To Render: " << duration << "\n";
-  if (recording) {
-    exportToPPM(defaultPPMFileName + std::to_string(currentFrame) + ".ppm", CreateImageFileFromWindow(window, W, H)); 
-    currentFrame++;
-  }
-} 
+}
 
 
 
@@ -409,14 +530,14 @@ void handleEvent(SDL_Event event) {
       currentRender = WIREFRAME;
       resetToOriginalScene();
 
-      // 0) Read in Hackspace logo, scale and append to object list.
-      vector<Object> hackspaceLogo = readGroupedOBJ("logo.obj", "logo.mtl", 0.06);
-      hackspaceLogo.at(0).ApplyColour(Colour(0,0, 255), true);
-      hackspaceLogo.at(0).Move(vec3(-1,0,0), 0.7);
-      hackspaceLogo.at(0).Move(vec3(0,0,-1), 1.7);
-      hackspaceLogo.at(0).Move(vec3(0,1, 0), 1.5);
-      hackspaceLogo.at(0).RotateXZ(pi/8);
-      objects.push_back(hackspaceLogo.at(0));
+      // 0) Read in Hackspace logo, scale and append to object list (as an instance, which only moves its transform).
+      Object hackspaceLogo(readOBJMesh("logo.obj", "logo.mtl", 0.06), mat4(1));
+      hackspaceLogo.ApplyColour(Colour(0,0, 255), true);
+      hackspaceLogo.Move(vec3(-1,0,0), 0.7);
+      hackspaceLogo.Move(vec3(0,0,-1), 1.7);
+      hackspaceLogo.Move(vec3(0,1, 0), 1.5);
+      hackspaceLogo.RotateXZ(pi/8);
+      objects.push_back(hackspaceLogo);
       
       // 1) Spin around.
       spinAround(pi, 100, true, -1);
@@ -472,7 +593,7 @@ void handleEvent(SDL_Event event) {
       objects.at(0).ApplyColour(Colour(255, 131, 0), true);
       
       //Hinge light to Bottom of the Hackspace Logo.
-      lightPosition.y = objects.at(0).getLowestYValue();
+      lights.at(0).position.y = objects.at(0).getLowestYValue();
       
       ReRenderWait(60);
       
@@ -499,12 +620,12 @@ void handleEvent(SDL_Event event) {
     else if(event.key.keysym.sym == SDLK_0)     {
       currentRender = RAYTRACE;
       resetToOriginalScene();
-      vector<Object> hackspaceLogo = readGroupedOBJ("logo.obj", "logo.mtl", 0.06);
-      hackspaceLogo.at(0).Move(vec3(0,0,-1), 0.7);
-      hackspaceLogo.at(0).Move(vec3(-1,0,0), 2.5);
-      hackspaceLogo.at(0).SnapToY0();
-      hackspaceLogo.at(0).ApplyMaterial(TEXTURE);
-      objects.push_back(hackspaceLogo.at(0));
+      Object hackspaceLogo(readOBJMesh("logo.obj", "logo.mtl", 0.06), mat4(1));
+      hackspaceLogo.Move(vec3(0,0,-1), 0.7);
+      hackspaceLogo.Move(vec3(-1,0,0), 2.5);
+      hackspaceLogo.SnapToY0();
+      hackspaceLogo.ApplyMaterial(TEXTURE);
+      objects.push_back(hackspaceLogo);
 
       cameraPosition[0] = GetSceneXCentre()[0]; 
 
@@ -518,13 +639,13 @@ void handleEvent(SDL_Event event) {
 
       for (int i=0; i<15; i++) render();
 
-      vector<Object> hsLogo = readGroupedOBJ("logo.obj", "logo.mtl", 0.06);
-      hsLogo.at(0).ApplyMaterial(GLASS);
-      hsLogo.at(0).Move(vec3(-1,0,0), 0.7);
-      hsLogo.at(0).Move(vec3(0,0,-1), 1.7);
-      hsLogo.at(0).Move(vec3(0,1, 0), 1.5);
-      hsLogo.at(0).RotateXZ(pi/8);
-      objects.push_back(hsLogo.at(0));
+      Object hsLogo(readOBJMesh("logo.obj", "logo.mtl", 0.06), mat4(1));
+      hsLogo.ApplyMaterial(GLASS);
+      hsLogo.Move(vec3(-1,0,0), 0.7);
+      hsLogo.Move(vec3(0,0,-1), 1.7);
+      hsLogo.Move(vec3(0,1, 0), 1.5);
+      hsLogo.RotateXZ(pi/8);
+      objects.push_back(hsLogo);
       render();
 
       // Hold me for around 0.3s.
@@ -549,26 +670,26 @@ void handleEvent(SDL_Event event) {
       objects.at(0).ApplyMaterial(NONE);
       objects.at(0).RotateXZ(-pi/20);
       cameraPosition.x = objects.at(0).GetCentre().x;
-      lightIntensity = 0;
-      lightPosition = cameraPosition;
+      lights.at(0).intensity = 0;
+      lights.at(0).position = cameraPosition;
       render();
       
-      lightIntensity = 20; 
+      lights.at(0).intensity = 20; 
       
       //Beautiful orange.
       objects.at(0).ApplyColour(Colour(255, 131, 0), true);
 
       //Hinge light to Bottom of the Hackspace Logo.
-      lightPosition.y = objects.at(0).getLowestYValue();
+      lights.at(0).position.y = objects.at(0).getLowestYValue();
       
       // Slide for 60 frames --- Light Intensity Slider ( from 20 -> 100 )
       for (int i=0; i<60; i++) {
-        lightIntensity += 1.25;
+        lights.at(0).intensity += 1.25;
         render();
       }
 
       //Move from RGB(255, 170, 0) to (255, 130, 0) [ The Perfect Hackspace Orange ].
-      lightIntensity = 120;
+      lights.at(0).intensity = 120;
       render();
     }
 
@@ -582,6 +703,10 @@ void handleEvent(SDL_Event event) {
       currentFrame++;
     }
 
+    else if(event.key.keysym.sym == SDLK_b) {
+      benchmarkRays();
+    }
+
     else if(event.key.keysym.sym == SDLK_r) {
       recording = !recording;
       if (recording) cout << "Recording Started\n";
@@ -595,18 +720,18 @@ void handleEvent(SDL_Event event) {
   // for the 1st object
   vec3 sum (0,0,0);
   Object object1 = objects.at(6);
-  int n1 = object1.faces.size();
+  int n1 = object1.FaceCount();
   for (int i = 0 ; i < n1 ; i++){
     for (int j = 0 ; j < 3 ; j++){
-      sum += object1.faces[i].vertices[j];
+      sum += object1.WorldVertex(i, j);
     }
   }
   // for the 2nd object
   Object object2 = objects.at(7);
-  int n2 = object2.faces.size();
+  int n2 = object2.FaceCount();
   for (int i = 0 ; i < n2 ; i++){
     for (int j = 0 ; j < 3 ; j++){
-      sum += object2.faces[i].vertices[j];
+      sum += object2.WorldVertex(i, j);
     }
   }
   vec3 centre = sum / float((n1*3) + (n2*3));
@@ -620,6 +745,8 @@ void handleEvent(SDL_Event event) {
 
 
 void clear(){ 
+  // the pixels the raytracer would keep are gone
+  forgetRaytracedFrame();
   window.clearPixels(); 
   for (int i = 0; i < (HEIGHT*WIDTH); i++) 
     depthMap[i] = numeric_limits<float>::infinity(); 
@@ -718,7 +845,9 @@ void updateView (MOVEMENT movement) {
     cameraForward = cameraOrientation[2];
   }
 
-  render();
+  // raytracing a whole frame takes a while, so show a rough one first and let the main loop sharpen it
+  if ((currentRender == RAYTRACE) && useProgressiveRefinement) startProgressiveRender();
+  else render();
 } 
  
 void lookAt(vec3 point){
@@ -1151,8 +1280,9 @@ void rasterize(){
   for (int o = 0; o < objects.size(); o++){
     if (!objects.at(o).hidden) {
       // for each face 
-      for (int i = 0 ; i < objects[o].faces.size() ; i++) { 
-        ModelTriangle triangle = objects[o].faces[i]; 
+      for (int i = 0 ; i < objects[o].FaceCount() ; i++) { 
+        // an instance's vertices are moved from its mesh's space into the world here
+        ModelTriangle triangle = objects[o].WorldFace(i); 
         CanvasTriangle canvasTriangle; 
         canvasTriangle.colour = triangle.colour;
         canvasTriangle.textured = (triangle.material == TEXTURE);
@@ -1203,29 +1333,202 @@ void rasterize(){
 // RAYTRACING CODE 
 //////////////////////////////////////////////////////// 
   
+// what happened when updating the trees and how much work the rays did in them
+// every thread counts its own rays in traversalStats, and the totals for the last frame are added up in frameStats
+struct TraversalStats {
+  int objectsBuilt;
+  int objectsRefit;
+  int meshesBuilt; // trees built for meshes shared by instances
+  double updateTime; // seconds spent building and refitting
+  long rays;
+  long nodesVisited; // number of bounding boxes tested
+  long trianglesTested;
+  long shadowRays; // the same again for the occlusion queries
+  long shadowNodesVisited;
+  long shadowTrianglesTested;
+  long packets; // camera rays traced together by closestHitPacket
+  long packetRays;
+  long packetNodesVisited; // each box test counts once for the whole packet
+  long packetTrianglesTested; // but each triangle test counts once per ray
+  long singlePrimaryRays; // camera rays traced one at a time, because their packet wasn't coherent or packets are off
+  long secondaryRays; // reflected and refracted rays traced
+  long raysSaved; // reflected and refracted rays not traced because of minimumRayWeight
+  long lightQueries; // points that looked for the lights bright enough there to shade with
+  long lightNodesVisited; // number of light BVH boxes tested
+  long lightsShaded; // lights those points shaded with
+  long softShadowPoints; // points that sampled the area light
+  long softShadowSamples;
+  long pixelsReused; // screen pixels coloured in from the last frame by temporal reprojection
+  long recordsReused; // triangle records kept from the last frame, as their object hadn't changed
+  long normalsReused; // face normals read from the triangle records when shading, instead of being worked out again (not for instances, whose normals are transformed from their mesh's records)
+  long occluderCacheHits; // shadow rays found to be blocked by the face in the occluder cache
+  long occluderCacheMisses; // shadow rays that had to search the scene
+  long shadowRaysAvoided; // shadow queries answered without searching the scene - the lights culled at each shading point, which never need one, and the occluder cache hits
+
+  void Add(const TraversalStats &other) {
+    objectsBuilt += other.objectsBuilt;
+    objectsRefit += other.objectsRefit;
+    meshesBuilt += other.meshesBuilt;
+    updateTime += other.updateTime;
+    rays += other.rays;
+    nodesVisited += other.nodesVisited;
+    trianglesTested += other.trianglesTested;
+    shadowRays += other.shadowRays;
+    shadowNodesVisited += other.shadowNodesVisited;
+    shadowTrianglesTested += other.shadowTrianglesTested;
+    packets += other.packets;
+    packetRays += other.packetRays;
+    packetNodesVisited += other.packetNodesVisited;
+    packetTrianglesTested += other.packetTrianglesTested;
+    singlePrimaryRays += other.singlePrimaryRays;
+    secondaryRays += other.secondaryRays;
+    raysSaved += other.raysSaved;
+    lightQueries += other.lightQueries;
+    lightNodesVisited += other.lightNodesVisited;
+    lightsShaded += other.lightsShaded;
+    softShadowPoints += other.softShadowPoints;
+    softShadowSamples += other.softShadowSamples;
+    pixelsReused += other.pixelsReused;
+    recordsReused += other.recordsReused;
+    normalsReused += other.normalsReused;
+    occluderCacheHits += other.occluderCacheHits;
+    occluderCacheMisses += other.occluderCacheMisses;
+    shadowRaysAvoided += other.shadowRaysAvoided;
+  }
+};
+thread_local TraversalStats traversalStats;
+TraversalStats frameStats;
+
+// the last opaque face that blocked a shadow ray to each light - neighbouring points in shadow are nearly always
+// blocked by the same face (like one of the boxes), so occlusion tests it before searching the scene
+// each thread has its own, and it is forgotten at the start of every tile, so it never points at a face that has moved
+const int OCCLUDER_CACHE_LIGHTS = 8; // lights after these aren't cached
+
+struct OccluderCache {
+  int objectIndex[OCCLUDER_CACHE_LIGHTS]; // -1 if nothing has blocked this light yet
+  int faceIndex[OCCLUDER_CACHE_LIGHTS];
+
+  OccluderCache() {
+    Clear();
+  }
+
+  void Clear() {
+    for (int l = 0; l < OCCLUDER_CACHE_LIGHTS; l++) objectIndex[l] = -1;
+  }
+};
+thread_local OccluderCache occluderCache;
+
+// the camera the frame being raytraced is seen from, set by prepareRaytracer - the tiles all use this instead of
+// cameraPosition etc., so they can't see the camera half way through a change
+Camera raytracerCamera;
+
+// the threads that render the tiles - they are started the first time we raytrace, and again if numberOfThreads changes
+ThreadPool raytracerThreads;
+int raytracerThreadsStarted = -1; // the numberOfThreads the pool was started with
+
 // this will be the main function for the raytracer 
+// the tiles are rendered in parallel, and while they are the scene is only read - each pixel's colour only depends on
+// the scene, so the image comes out the same however the tiles are shared out between the threads
 void raytracer(){
-  // for each pixel 
-  for (int i = 0 ; i < WIDTH ; i++){ 
-    //#pragma clang loop vectorize_width(8) interleave_count(8)
-    for (int j = 0 ; j < HEIGHT ; j++){
-      // create a ray 
-      vec3 rayDirection = createRay(i,j);
-      // shoot the ray and check for intersections 
-      Colour colour = shootRay(cameraPosition, rayDirection, 0, 1); // depth starts at 0, IOR is 1 as travelling in air
-      // colour the pixel accordingly 
-      SetBufferColour(i, j, colour.toUINT32_t()); 
-    } 
-  } 
+  prepareRaytracer();
+  // the build stats come from this thread, and the ray stats are added on as each thread finishes a tile
+  frameStats = traversalStats;
+  traversalStats = TraversalStats();
+
+  // the tiles that nothing could have changed since the last frame are left as they are
+  vector<bool> dirtyTiles;
+  const int dirtyTileCount = findDirtyTiles(dirtyTiles);
+  const vector<bool> *onlyTiles = (dirtyTileCount < TILES_ACROSS * TILES_DOWN) ? &dirtyTiles : NULL;
+  const bool adaptive = useAdaptiveAA && (AA > 1) && !useWavefront;
+  // if only the camera has moved (and maybe a few objects), the colours of the points the last frame saw can be used again
+  const bool reproject = adaptive && prepareReprojection();
+  if (adaptive) {
+    // one sample per pixel first, and then the rest of the samples only where they are needed
+    raytraceTiles(0, TILES_ACROSS * TILES_DOWN, [reproject](int x, int y) {
+      renderTilePixelSamples(x, y, reproject);
+    }, onlyTiles);
+    markAdaptivePixels();
+    raytraceTiles(0, TILES_ACROSS * TILES_DOWN, renderTileAdaptive, onlyTiles);
+  }
+  else raytraceTiles(0, TILES_ACROSS * TILES_DOWN, renderTile, onlyTiles);
+  recordRaytracedFrame();
+  if (displayRenderTime) cout << "Retraced " << dirtyTileCount << " of " << (TILES_ACROSS * TILES_DOWN) << " tiles\n";
+  if (displayRenderTime && reproject) cout << "Reused " << frameStats.pixelsReused << " of " << (W * H) << " pixels (" << (100.0f * frameStats.pixelsReused / (W * H)) << "%) from the last frame\n";
+
+  if (displayBVHStats) printBVHStats();
+  if (displayThreadStats) printThreadStats();
 } 
+
+// calls renderTileAt(x,y) for tiles firstTile to firstTile + tileCount - 1 (numbered across and then down) on the
+// raytracing threads, where (x,y) is the tile's top left corner, and adds the rays they traced to frameStats
+// if onlyTiles is given, the tiles it has as false are skipped
+void raytraceTiles(int firstTile, int tileCount, std::function<void(int, int)> renderTileAt, const vector<bool> *onlyTiles){
+  if (raytracerThreadsStarted != numberOfThreads) {
+    raytracerThreads.Start(numberOfThreads);
+    raytracerThreadsStarted = numberOfThreads;
+  }
+  vector<TraversalStats> workerStats(raytracerThreads.Size(), TraversalStats());
+  raytracerThreads.Run(tileCount, [&](int task, int worker) {
+    const int tile = firstTile + task;
+    if (onlyTiles && !(*onlyTiles)[tile]) return;
+    occluderCache.Clear();
+    renderTileAt((tile % TILES_ACROSS) * TILE_SIZE, (tile / TILES_ACROSS) * TILE_SIZE);
+    workerStats[worker].Add(traversalStats);
+    traversalStats = TraversalStats();
+  });
+  for (int w = 0; w < (int)workerStats.size(); w++) frameStats.Add(workerStats[w]);
+}
+
+// renders the tile whose top left corner is pixel (x,y)
+void renderTile(int x, int y){
+  if (useWavefront) {
+    renderTileWavefront(x, y);
+    return;
+  }
+  const int xEnd = std::min(x + TILE_SIZE, WIDTH);
+  const int yEnd = std::min(y + TILE_SIZE, HEIGHT);
+  if (useBVH && usePacketTracing) {
+    // neighbouring camera rays go through nearly the same nodes, so trace them a square at a time
+    for (int j = y ; j < yEnd ; j += PACKET_WIDTH){
+      for (int i = x ; i < xEnd ; i += PACKET_WIDTH) tracePrimaryPacket(i, j);
+    }
+  }
+  else {
+    // for each row of pixels, create the rays
+    vec3 rayDirections[TILE_SIZE];
+    for (int j = y ; j < yEnd ; j++){
+      raytracerCamera.RowDirections(x, j, xEnd - x, rayDirections);
+      for (int i = x ; i < xEnd ; i++){ 
+        // shoot the ray and check for intersections 
+        Colour colour = shootRay(raytracerCamera.position, rayDirections[i - x], 0, 1); // depth starts at 0, IOR is 1 as travelling in air
+        // colour the pixel accordingly 
+        SetBufferColour(i, j, colour.toUINT32_t()); 
+      } 
+    } 
+  }
+}
+
+void printThreadStats(){
+  cout << "Threads: " << raytracerThreads.Size() << " threads rendered the frame in " << (raytracerThreads.runTime * 1000) << "ms\n";
+  for (int w = 0; w < raytracerThreads.Size(); w++) {
+    const WorkerStats stats = raytracerThreads.GetWorkerStats(w);
+    const float utilisation = (raytracerThreads.runTime > 0) ? (100 * stats.busyTime / raytracerThreads.runTime) : 0;
+    cout << "Threads: thread " << w << " rendered " << stats.tasksRun << " tiles (" << stats.tasksStolen << " stolen), busy for " << utilisation << "% of the frame\n";
+  }
+}
  
-Colour solveLight(RayTriangleIntersection closest, vec3 rayDirection, float Ka, float Kd, float Ks) { 
-  // diffuse light 
-  Kd *= (intensityDropOff(closest.intersectionPoint) * angleOfIncidence(closest));
-  // specular light 
-  //closest.normal -  this is the interpolated noral for Phong shading (it is previously calculated and stored in the RayTriangleIntersection object) 
-  Ks *= calculateSpecularLight(closest.intersectionPoint, rayDirection, closest.normal); 
-  return getFinalColour(closest.intersectedTriangle.colour, Ka, Kd, Ks); 
+Colour solveLight(const RayTriangleIntersection &closest, vec3 rayDirection, float Ka, float Kd, float Ks) { 
+  float diffuse = 0, specular = 0;
+  forEachLightAt(closest.intersectionPoint, false, [&](int l, float fade) {
+    // diffuse light 
+    diffuse += fade * intensityDropOff(closest.intersectionPoint, lights[l]) * angleOfIncidence(closest, lights[l]);
+    // specular light 
+    //closest.normal -  this is the interpolated noral for Phong shading (it is previously calculated and stored in the RayTriangleIntersection object) 
+    specular += fade * calculateSpecularLight(closest.intersectionPoint, rayDirection, closest.normal, lights[l]); 
+  });
+  Kd *= diffuse;
+  Ks *= specular;
+  return getFinalColour(objects[closest.objectIndex].FaceColour(closest.faceIndex), Ka, Kd, Ks); 
 } 
 
 //OPTIMISED - Compute only once outside the loop. 
@@ -1233,182 +1536,1340 @@ Colour solveLight(RayTriangleIntersection closest, vec3 rayDirection, float Ka,
 const float pixelSizeX = imageWidth/WIDTH;
 const float pixelSizeY = imageHeight/HEIGHT;
 
-// given the pixel coordinates, this function calculates the direction of the ray (in vector format) 
-vec3 createRay(const int i, const int j) {
-  //vec2 pixel(float(i)+0.5,float(j)+0.5); //pixel = pixel + vec2(0.5,0.5); 
-  //vec2 distanceFromCentre = pixel - vec2(WIDTH/2, HEIGHT/2); // distance from the pixel to the centre of the image plane in terms of number of pixels 
-  const float horizontalDistance = pixelSizeX * (float(i) + 0.5 - (WIDTH/2)); //pixel[0] * distanceFromCentre[0]
-  const float verticalDistance = pixelSizeY * (float(j) + 0.5 - (HEIGHT/2));  //pixel[1] * distanceFromCentre[1]
-  const vec3 imagePlaneCentre = cameraPosition - (focalLength * cameraForward); // this is the 3D coordinate of the centre of the image plane 
-  const vec3 point = imagePlaneCentre + (horizontalDistance * cameraRight) + (verticalDistance * (-cameraUp)); 
-  return normalize(point - cameraPosition); //Return direction.
-} 
- 
-// this function takes the ray and checks with all the faces to see which ones it intersects 
-// it outputs a vector of vectors - a (t,u,v) vector for each face 
-// if t>0, then that means that for that particular face the ray intersects it with u and v being local coordinates for the triangle 
-vector<vector<vec4>> checkForIntersections(vec3 point, vec3 rayDirection){ 
-  // this is the output vector, for every possible face it stores a possibleSolution 
-  // the 4th value in this vector is the index of the face if there is an intersection
-  // there is an element in solutions ofr every object
-  // each element in solutions is a vector of possible solutions for all the faces in that object
-  vector<vector<vec4>> solutions;
-
-  // for each object, does it have a bounding box?
-  // if so, does the ray intersect it?
-  // if so, which of the faces in that object does the ray intersect?
-  for (int i = 0 ; i < objects.size(); i++) {
-
-    vector<vec4> objectSolutions; // to store the solutions if any for this object
-    objectSolutions.push_back(vec4 (-1,0,0,-1));
-    if (objects[i].hasBoundingBox){
-      vector<vec4> boxSolutions = faceIntersections(objects[i].boxFaces, point, rayDirection);
-      // do we intersect the bounding box?
-      for (int j = 0; j < boxSolutions.size(); j++){
-        // if we have an intersection, then check for intersections with all the faces
-        if (boxSolutions[j][0] > 0){
-          solutions.push_back(faceIntersections(objects[i].faces, point, rayDirection));
-          break;
+// fills in the intersection record for a ray (starting at rayPoint) that hits face faceIndex of object objectIndex at local coordinates (u,v)
+RayTriangleIntersection createIntersection(int objectIndex, int faceIndex, float u, float v, vec3 rayPoint) {
+  RayTriangleIntersection intersection;
+  intersection.objectIndex = objectIndex;
+  intersection.faceIndex = faceIndex;
+  const Object &object = objects[objectIndex];
+  const ModelTriangle &triangle = object.LocalFace(faceIndex);
+  const TriangleRecord &record = object.Records()[faceIndex];
+
+  // calculating the point of intersection 
+  intersection.intersectionPoint = record.v0 + (u * record.e0) + (v * record.e1); 
+  if (object.IsInstance()) intersection.intersectionPoint = vec3(object.transform * vec4(intersection.intersectionPoint, 1));
+
+  // calculating the distance between the camera and intersection point 
+  const vec3 d = intersection.intersectionPoint - rayPoint; 
+  intersection.distanceFromCamera = sqrt( (d[0]*d[0]) + (d[1] * d[1]) + (d[2] * d[2]));
+
+  // calculating the normal of the intersection 
+  const vec3 n0 = triangle.normals[0]; 
+  const vec3 n1 = triangle.normals[1]; 
+  const vec3 n2 = triangle.normals[2]; 
+  intersection.normal = n0 + (u * (n1 - n0)) + (v * (n2 - n0));
+  if (object.IsInstance()) intersection.normal = object.normalTransform * intersection.normal;
+  intersection.faceNormal = object.WorldFaceNormal(faceIndex);
+
+  intersection.intersectUV = vec2(u, v);
+  return intersection;
+}
+
+// the face an intersection is on - the objects aren't changed while a frame is raytraced, so this stays valid until then
+// (for an instance this is the mesh's face, so only its texture points are the same as the world's - the colour and
+// material to shade with come from the object's FaceColour and FaceMaterial)
+const ModelTriangle &hitTriangle(const RayTriangleIntersection &intersection) {
+  return objects[intersection.objectIndex].LocalFace(intersection.faceIndex);
+}
+
+//////////////////////////////////////////////////////// 
+// PROGRESSIVE RENDERING
+//////////////////////////////////////////////////////// 
+
+// where the progressive render has got to - each pass traces the samples on a coarser grid's gaps, so by the end every
+// sample has been traced once and the image is the same as the one raytracer makes
+struct ProgressiveRender {
+  int pass; // the pass being traced, or PROGRESSIVE_PASSES when there is nothing left to do
+  int nextTileRow; // the fine passes are traced a row of tiles at a time, so new input never waits long
+  std::chrono::steady_clock::time_point start;
+};
+ProgressiveRender progressiveRender = {PROGRESSIVE_PASSES, 0, std::chrono::steady_clock::time_point()};
+
+// throws away the image being refined and starts again with the first (coarsest) pass, which is shown straight away
+void startProgressiveRender(){
+  progressiveRender.pass = 0;
+  progressiveRender.nextTileRow = 0;
+  progressiveRender.start = std::chrono::steady_clock::now();
+  // the coarse passes draw over the last frame
+  forgetRaytracedFrame();
+  prepareRaytracer();
+  frameStats = traversalStats;
+  traversalStats = TraversalStats();
+  while (progressiveRender.pass == 0) refineProgressiveRender();
+}
+
+// traces the next part of the current pass, and shows the image once the pass is done
+// returns false if there was nothing left to refine
+bool refineProgressiveRender(){
+  if (progressiveRender.pass >= PROGRESSIVE_PASSES) return false;
+  const int step = progressiveStep(progressiveRender.pass);
+  const int previousStep = (progressiveRender.pass > 0) ? progressiveStep(progressiveRender.pass - 1) : 0;
+  // the passes with at most one sample per 2x2 pixels are quick enough to do in one go
+  const int rows = (step > AA) ? TILES_DOWN : 1;
+  // with adaptive anti-aliasing, the last pass only adds samples to the pixels on edges
+  const bool adaptive = useAdaptiveAA && (step < AA);
+  if (adaptive && (progressiveRender.nextTileRow == 0)) markAdaptivePixels();
+  raytraceTiles(progressiveRender.nextTileRow * TILES_ACROSS, rows * TILES_ACROSS, [&](int x, int y) {
+    if (adaptive) renderTileAdaptive(x, y);
+    else renderTileSamples(x, y, step, previousStep);
+  });
+  progressiveRender.nextTileRow += rows;
+  if (progressiveRender.nextTileRow < TILES_DOWN) return true;
+
+  fillProgressiveBlocks(step);
+  showPixelBuffer();
+  window.renderFrame();
+  progressiveRender.pass++;
+  progressiveRender.nextTileRow = 0;
+  if (progressiveRender.pass == PROGRESSIVE_PASSES) {
+    // the finished image is the same as the one raytracer would have made, so the next frame can build on it
+    recordRaytracedFrame();
+    double duration = std::chrono::duration<double>(std::chrono::steady_clock::now() - progressiveRender.start).count();
+    if (displayRenderTime) cout << "Time Taken To Refine: " << duration << "\n";
+    if (displayBVHStats) printBVHStats();
+    // a camera move is only recorded once it is at full quality, like a frame from render
+    exportRecordedFrame();
+  }
+  return true;
+}
+
+void stopProgressiveRender(){
+  progressiveRender.pass = PROGRESSIVE_PASSES;
+}
+
+// the spacing (in samples) of the grid that pass traces
+int progressiveStep(int pass){
+  if (pass >= 4) return 1;
+  return (8 >> pass) * AA;
+}
+
+// traces the samples of the tile whose top left corner is (x,y) that are on the step grid but weren't on the
+// previousStep grid (which earlier passes have already traced - 0 if there wasn't an earlier pass)
+void renderTileSamples(int x, int y, int step, int previousStep){
+  const int xEnd = std::min(x + TILE_SIZE, WIDTH);
+  const int yEnd = std::min(y + TILE_SIZE, HEIGHT);
+  for (int j = ((y + step - 1) / step) * step; j < yEnd; j += step) {
+    for (int i = ((x + step - 1) / step) * step; i < xEnd; i += step) {
+      if ((previousStep > 0) && (i % previousStep == 0) && (j % previousStep == 0)) continue;
+      if ((i % AA == 0) && (j % AA == 0)) {
+        tracePixelSample(i, j);
+        continue;
+      }
+      Colour colour = shootRay(raytracerCamera.position, raytracerCamera.Direction(i, j), 0, 1); // depth starts at 0, IOR is 1 as travelling in air
+      SetBufferColour(i, j, colour.toUINT32_t());
+    }
+  }
+}
+
+// gives the samples that haven't been traced yet the colour of the traced sample at the top left of their step x step block
+void fillProgressiveBlocks(int step){
+  if (step == 1) return;
+  for (int y = 0; y < HEIGHT; y++) {
+    for (int x = 0; x < WIDTH; x++) {
+      const int sourceX = x - (x % step);
+      const int sourceY = y - (y % step);
+      if (AA == 1) window.setPixelColour(x, y, window.getPixelColour(sourceX, sourceY));
+      else pixelBuffer[x + (y * WIDTH)] = pixelBuffer[sourceX + (sourceY * WIDTH)];
+    }
+  }
+}
+
+//////////////////////////////////////////////////////// 
+// ADAPTIVE ANTI-ALIASING
+//////////////////////////////////////////////////////// 
+
+// the first sample of every screen pixel is the one at the top left of its AA x AA block, and this is what it hit -
+// neighbouring pixels that hit different things (or came out a different colour) are on an edge and get supersampled
+struct PixelSample {
+  float depth; // distance from the camera, or -1 if the ray hit nothing
+  int objectIndex;
+  MATERIAL material;
+  bool supersampled; // set by markAdaptivePixels
+  int age; // how many frames in a row the colour has been reused by temporal reprojection
+};
+vector<PixelSample> pixelSamples(W * H);
+
+// traces sample (i,j), the top left sample of screen pixel (i/AA, j/AA), and remembers what it hit
+// with reuseLastFrame, the colour is taken from the last frame instead of being worked out again if it can be
+void tracePixelSample(int i, int j, bool reuseLastFrame){
+  const vec3 rayDirection = raytracerCamera.Direction(i, j);
+  traversalStats.singlePrimaryRays++;
+  RayHit hit;
+  closestHit(raytracerCamera.position, rayDirection, hit);
+  finishPixelSample(i, j, hit, rayDirection, reuseLastFrame);
+}
+
+// remembers what the camera ray through sample (i,j) hit, and colours the sample in
+void finishPixelSample(int i, int j, const RayHit &hit, vec3 rayDirection, bool reuseLastFrame){
+  PixelSample &sample = pixelSamples[(i / AA) + ((j / AA) * W)];
+  RayTriangleIntersection closest;
+  if (hit.IsHit()) {
+    closest = createIntersection(hit.objectIndex, hit.faceIndex, hit.u, hit.v, raytracerCamera.position);
+    sample.depth = closest.distanceFromCamera;
+    sample.objectIndex = hit.objectIndex;
+    sample.material = objects[hit.objectIndex].FaceMaterial(hit.faceIndex);
+  }
+  else {
+    closest.distanceFromCamera = -1; // no intersection
+    sample.depth = -1;
+    sample.objectIndex = -1;
+    sample.material = NONE;
+  }
+  sample.age = 0;
+  uint32_t reused;
+  if (reuseLastFrame && reprojectedColour(i, j, hit, closest, rayDirection, reused)) {
+    traversalStats.pixelsReused++;
+    SetBufferColour(i, j, reused);
+    return;
+  }
+  Colour colour = shadeIntersection(closest, rayDirection, 0, 1); // depth starts at 0, IOR is 1 as travelling in air
+  SetBufferColour(i, j, colour.toUINT32_t());
+}
+
+// traces the first sample of every screen pixel in the tile whose top left corner is (x,y) - with reuseLastFrame the
+// colours from the last frame are used where they can be
+// with packets, the first samples of 8x8 screen pixels are traced together, like renderTile does for every sample
+void renderTilePixelSamples(int x, int y, bool reuseLastFrame){
+  const int xEnd = std::min(x + TILE_SIZE, WIDTH);
+  const int yEnd = std::min(y + TILE_SIZE, HEIGHT);
+  const int xStart = ((x + AA - 1) / AA) * AA;
+  const int yStart = ((y + AA - 1) / AA) * AA;
+  if (useBVH && usePacketTracing) {
+    for (int j = yStart; j < yEnd; j += PACKET_WIDTH * AA) {
+      for (int i = xStart; i < xEnd; i += PACKET_WIDTH * AA) tracePixelSamplePacket(i, j, xEnd, yEnd, reuseLastFrame);
+    }
+    return;
+  }
+  for (int j = yStart; j < yEnd; j += AA) {
+    for (int i = xStart; i < xEnd; i += AA) tracePixelSample(i, j, reuseLastFrame);
+  }
+}
+
+// picks out the pixels that need all of their samples, by comparing every pixel's first sample with the pixels to
+// its right and below it
+void markAdaptivePixels(){
+  for (int p = 0; p < W * H; p++) pixelSamples[p].supersampled = false;
+  int supersampled = 0;
+  for (int y = 0; y < H; y++) {
+    for (int x = 0; x < W; x++) {
+      const int p = x + (y * W);
+      if ((x + 1 < W) && differentPixels(p, p + 1)) {
+        pixelSamples[p].supersampled = true;
+        pixelSamples[p + 1].supersampled = true;
+      }
+      if ((y + 1 < H) && differentPixels(p, p + W)) {
+        pixelSamples[p].supersampled = true;
+        pixelSamples[p + W].supersampled = true;
+      }
+    }
+  }
+  if (showSamplesPerPixel) {
+    for (int p = 0; p < W * H; p++) supersampled += pixelSamples[p].supersampled;
+    cout << "Adaptive AA: " << supersampled << " of " << (W * H) << " pixels (" << (100.0f * supersampled / (W * H)) << "%) took " << (AA * AA) << " samples\n";
+  }
+}
+
+// true if screen pixels a and b (indices into pixelSamples) look different enough to be an edge
+bool differentPixels(int a, int b){
+  const PixelSample &first = pixelSamples[a];
+  const PixelSample &second = pixelSamples[b];
+  if ((first.objectIndex != second.objectIndex) || (first.material != second.material)) return true;
+  // (if one missed, they both did, as they have the same objectIndex)
+  if ((first.objectIndex != -1) && (std::abs(first.depth - second.depth) > adaptiveAADepthThreshold * std::min(first.depth, second.depth))) return true;
+  const uint32_t colourA = pixelBuffer[((a % W) * AA) + ((a / W) * AA * WIDTH)];
+  const uint32_t colourB = pixelBuffer[((b % W) * AA) + ((b / W) * AA * WIDTH)];
+  return (std::abs(getRedValueFromColor(colourA) - getRedValueFromColor(colourB)) > adaptiveAAColourThreshold) ||
+         (std::abs(getGreenValueFromColor(colourA) - getGreenValueFromColor(colourB)) > adaptiveAAColourThreshold) ||
+         (std::abs(getBlueValueFromColor(colourA) - getBlueValueFromColor(colourB)) > adaptiveAAColourThreshold);
+}
+
+// finishes off the screen pixels in the tile whose top left corner is (x,y), once they all have their first sample -
+// pixels on an edge get the rest of their samples traced, and the others have their first sample copied over the
+// rest of their block, so averaging the block in showPixelBuffer gives the right colour either way
+void renderTileAdaptive(int x, int y){
+  const int xEnd = std::min(x + TILE_SIZE, WIDTH);
+  const int yEnd = std::min(y + TILE_SIZE, HEIGHT);
+  for (int j = ((y + AA - 1) / AA) * AA; j < yEnd; j += AA) {
+    for (int i = ((x + AA - 1) / AA) * AA; i < xEnd; i += AA) {
+      const bool supersampled = pixelSamples[(i / AA) + ((j / AA) * W)].supersampled;
+      uint32_t colour = pixelBuffer[i + (j * WIDTH)];
+      if (showSamplesPerPixel) {
+        const int grey = supersampled ? 255 : (255 / (AA * AA));
+        colour = Colour(grey, grey, grey).toUINT32_t();
+      }
+      for (int jj = 0; jj < AA; jj++) {
+        for (int ii = 0; ii < AA; ii++) {
+          if ((ii == 0) && (jj == 0) && !showSamplesPerPixel) continue;
+          if (supersampled && !showSamplesPerPixel) {
+            // the samples are spread evenly over the pixel, or jittered about inside their cells
+            vec2 offset(0.5f, 0.5f);
+            if (jitterAASamples) offset = vec2(hashRandom(vec3(i + ii, j + jj, 0), vec3(1, 0, 0)), hashRandom(vec3(i + ii, j + jj, 0), vec3(0, 1, 0)));
+            colour = shootRay(raytracerCamera.position, raytracerCamera.Direction(float(i + ii) + offset.x, float(j + jj) + offset.y), 0, 1).toUINT32_t();
+          }
+          SetBufferColour(i + ii, j + jj, colour);
         }
       }
     }
-    // if this object doesn't have a bounding box, then just check each face as normal
-    else {
-      solutions.push_back(faceIntersections(objects[i].faces, point, rayDirection));
+  }
+}
+
+//////////////////////////////////////////////////////// 
+// ACCELERATION STRUCTURE 
+//////////////////////////////////////////////////////// 
+
+// this is a two level structure - every object has its own BVH over its faces (the bottom level), and the top level BVH
+// is built over the bounding boxes of the objects. when an object moves only its own tree needs updating, and as long
+// as it still has the same number of faces we refit the old tree rather than building a new one.
+// instances (see Mesh.h) share one tree per mesh, built in the mesh's own space and never refit, since the mesh never
+// changes - a ray is taken into the mesh's space before it goes down an instance's tree.
+
+struct ObjectBVH {
+  unsigned long version; // the Object::version this tree matches
+  int faceCount;
+  float builtCost; // SAH cost straight after the last full build - refitting makes this grow
+  BVH bvh;
+  vector<TriangleBlock> blocks; // the faces in leaf order, 8 to a block, with each leaf starting a new block
+  vector<int> firstBlock; // firstBlock[leaf.firstIndex] is the first block of that leaf
+};
+
+vector<ObjectBVH> objectBVHs; // objectBVHs[o] is the tree for objects[o] (unused for instances)
+map<unsigned long, ObjectBVH> meshBVHs; // the trees for the meshes of the instances, by Mesh::id
+vector<const ObjectBVH *> bottomLevelBVHs; // bottomLevelBVHs[o] is the tree the rays go down for objects[o]
+BVH topLevelBVH;
+vector<int> topLevelObjects; // the object each primitive of the top level BVH refers to (objects with no faces are left out)
+
+// once a refit tree is this many times more expensive than a freshly built one, build it again
+const float REFIT_COST_LIMIT = 1.5;
+
+// the widest triangle block test this CPU supports (AVX2, SSE or scalar)
+const char *triangleBlockKernelName;
+const TriangleBlockKernel intersectTriangleBlock = chooseTriangleBlockKernel(triangleBlockKernelName);
+
+
+BoundingBox getTriangleBox(const ModelTriangle &triangle) {
+  BoundingBox box;
+  box.Expand(triangle.vertices[0]);
+  box.Expand(triangle.vertices[1]);
+  box.Expand(triangle.vertices[2]);
+  return box;
+}
+
+// the box around every object in the scene, worked out at the start of each frame
+BoundingBox sceneBox;
+
+// gets everything the rays need ready for a new frame
+void prepareRaytracer() {
+  raytracerCamera.Set(cameraPosition, cameraRight, cameraUp, cameraForward, focalLength, vec2(pixelSizeX, pixelSizeY), WIDTH, HEIGHT);
+  // bring the precomputed triangle data up to date with any objects that have moved
+  sceneBox = BoundingBox();
+  long recordsReused = 0;
+  for (int o = 0; o < (int)objects.size(); o++) {
+    if (!objects[o].UpdateTriangleRecords()) recordsReused += objects[o].FaceCount();
+    sceneBox.Expand(objects[o].boundingBox);
+  }
+  if (useBVH) buildSceneBVH();
+  else traversalStats = TraversalStats();
+  traversalStats.recordsReused = recordsReused;
+  occluderCache.Clear();
+  buildLightBVH();
+}
+
+// brings every object's tree up to date with its vertices, then builds the top level over them
+void buildSceneBVH() {
+  std::clock_t start = std::clock();
+  traversalStats = TraversalStats();
+
+  objectBVHs.resize(objects.size());
+  bottomLevelBVHs.resize(objects.size());
+  vector<BoundingBox> objectBoxes;
+  topLevelObjects.clear();
+  set<unsigned long> meshesUsed;
+  for (int o = 0; o < (int)objects.size(); o++) {
+    if (objects[o].IsInstance()) {
+      const Mesh &mesh = *objects[o].mesh;
+      ObjectBVH &meshBVH = meshBVHs[mesh.id];
+      if (meshBVH.bvh.IsEmpty() && !mesh.faces.empty()) {
+        vector<BoundingBox> faceBoxes(mesh.faces.size());
+        for (int i = 0; i < (int)mesh.faces.size(); i++) faceBoxes[i] = getTriangleBox(mesh.faces[i]);
+        meshBVH.bvh.Build(faceBoxes, TRIANGLE_BLOCK_SIZE);
+        meshBVH.builtCost = meshBVH.bvh.Cost();
+        meshBVH.faceCount = mesh.faces.size();
+        buildTriangleBlocks(meshBVH, mesh.triangleRecords);
+        traversalStats.meshesBuilt++;
+      }
+      meshesUsed.insert(mesh.id);
+      bottomLevelBVHs[o] = &meshBVH;
+      // the instance's box goes in the top level, as the tree's own box is in the mesh's space
+      if (!mesh.faces.empty()) {
+        objectBoxes.push_back(objects[o].boundingBox);
+        topLevelObjects.push_back(o);
+      }
+      continue;
+    }
+
+    ObjectBVH &objectBVH = objectBVHs[o];
+    bottomLevelBVHs[o] = &objectBVH;
+    const int faceCount = objects[o].faces.size();
+    const bool sameFaces = !objectBVH.bvh.IsEmpty() && (objectBVH.faceCount == faceCount);
+    if (!sameFaces || (objectBVH.version != objects[o].version)) {
+      vector<BoundingBox> faceBoxes(faceCount);
+      for (int i = 0; i < faceCount; i++) faceBoxes[i] = getTriangleBox(objects[o].faces[i]);
+
+      if (sameFaces) {
+        objectBVH.bvh.Refit(faceBoxes);
+        traversalStats.objectsRefit++;
+      }
+      // a new object, or one that has been refit so often the tree no longer fits it well
+      if (!sameFaces || (objectBVH.bvh.Cost() > REFIT_COST_LIMIT * objectBVH.builtCost)) {
+        objectBVH.bvh.Build(faceBoxes, TRIANGLE_BLOCK_SIZE);
+        objectBVH.builtCost = objectBVH.bvh.Cost();
+        objectBVH.faceCount = faceCount;
+        traversalStats.objectsBuilt++;
+      }
+      buildTriangleBlocks(objectBVH, objects[o].triangleRecords);
+      objectBVH.version = objects[o].version;
     }
 
+    if (faceCount > 0) {
+      objectBoxes.push_back(objectBVH.bvh.nodes[0].box);
+      topLevelObjects.push_back(o);
+    }
   }
-  return solutions;
-} 
+  // forget the trees of meshes that no instance uses any more
+  for (map<unsigned long, ObjectBVH>::iterator m = meshBVHs.begin(); m != meshBVHs.end();) {
+    if (meshesUsed.count(m->first) == 0) m = meshBVHs.erase(m);
+    else ++m;
+  }
+  // there are only a handful of objects, so the top level is always built from scratch
+  topLevelBVH.Build(objectBoxes);
+  traversalStats.updateTime = (std::clock() - start) / (double) CLOCKS_PER_SEC;
+}
 
-vector<vec4> faceIntersections(vector<ModelTriangle> inputFaces, vec3 point, vec3 rayDirection){
-  // this is the output vector, for every possible face it stores a possibleSolution 
-  vector<vec4> solutions;
-
-  // for each face 
-  int n = inputFaces.size(); 
-  for (int i = 0 ; i < n ; i++){ 
-    ModelTriangle triangle = inputFaces[i];
-    // only check for intersections on the faces that face the camera
-    if (triangle.culled == false) {
-      // got the following code from the worksheet 
-      vec3 e0 = triangle.vertices[1] - triangle.vertices[0]; 
-      vec3 e1 = triangle.vertices[2] - triangle.vertices[0]; 
-      vec3 SPVector = point - triangle.vertices[0]; 
-      mat3 DEMatrix(-rayDirection, e0, e1); 
-      vec3 possibleSolution = glm::inverse(DEMatrix) * SPVector;
-      //add possiblesolution to solution list.
-      solutions.push_back( vec4(possibleSolution[0], possibleSolution[1], possibleSolution[2], triangle.faceIndex)); 
+// lays out the faces (given by their records) in blocks of 8, in the same order as the leaves of their tree
+void buildTriangleBlocks(ObjectBVH &objectBVH, const vector<TriangleRecord> &records) {
+  const BVH &bvh = objectBVH.bvh;
+  objectBVH.blocks.clear();
+  objectBVH.firstBlock.assign(bvh.indices.size(), -1);
+  for (int n = 0; n < (int)bvh.nodes.size(); n++) {
+    const BVHNode &node = bvh.nodes[n];
+    if (node.count == 0) continue;
+    objectBVH.firstBlock[node.firstIndex] = objectBVH.blocks.size();
+    for (int i = 0; i < node.count; i++) {
+      const int lane = i % TRIANGLE_BLOCK_SIZE;
+      if (lane == 0) {
+        objectBVH.blocks.push_back(TriangleBlock());
+        clearTriangleBlock(objectBVH.blocks.back());
+      }
+      const int f = bvh.indices[node.firstIndex + i];
+      setTriangleBlockLane(objectBVH.blocks.back(), lane, records[f], f);
     }
-    // if it has been culled then return a fake solution
-    else {
-      solutions.push_back(vec4 (-1,0,0,-1));
-    } 
-  } 
-  return solutions; 
-}
-
-// this function gives back the index of the closest face for a particular ray 
-RayTriangleIntersection closestIntersection(vector<vector<vec4>> objectSolutions, vec3 rayPoint) { 
-  RayTriangleIntersection closest; // this is where we store the closest triangle of intersection, the point it intersects and the distance 
-  closest.distanceFromCamera = -1; // initialize this so we can tell when there are no intersections 
-  float closestT = numeric_limits<float>::infinity(); 
-  int closestIndex = -1; 
-  // for each possible solution / for each face 
-  // for each object
-  for (int o=0; o<objectSolutions.size(); o++) {
-      vector<vec4> solutions = objectSolutions[o];
-      for (int i = 0 ; i < objects[o].faces.size() ; i++){ 
-        
-        vec4 possibleSolution = solutions[i]; 
-        const float t = possibleSolution[0]; 
-        const float u = possibleSolution[1]; 
-        const float v = possibleSolution[2];
-        const int index = possibleSolution[3];
-        
-        // if it is actually a solution 
-        bool bool1 = (t > 0); 
-        bool bool2 = (0 <= u) && (u <= 1) && (0 <= v) && (v <= 1) ; 
-        bool bool3 = (u + v) <= 1; 
-        if (bool1 && bool2 && bool3){ 
-          ModelTriangle triangle = objects[o].faces[index]; 
-          
-          // is it closer than what we currently have? 
-          if (t < closestT){ 
-            closestT = t; 
-            closestIndex = i; 
-            
-            // calculating the point of intersection 
-            const vec3 p0 = triangle.vertices[0]; 
-            const vec3 p1 = triangle.vertices[1]; 
-            const vec3 p2 = triangle.vertices[2]; 
-            const vec3 intersection = p0 + (u * (p1 - p0)) + (v * (p2 - p0)); 
-            closest.intersectionPoint = intersection; 
-
-            // calculating the distance between the camera and intersection point 
-            const vec3 d = intersection - rayPoint; 
-            closest.distanceFromCamera = sqrt( (d[0]*d[0]) + (d[1] * d[1]) + (d[2] * d[2]));
-
-            // calculating the normal of the intersection 
-            const vec3 n0 = triangle.normals[0]; 
-            const vec3 n1 = triangle.normals[1]; 
-            const vec3 n2 = triangle.normals[2]; 
-            closest.normal = n0 + (u * (n1 - n0)) + (v * (n2 - n0));
-
-            closest.intersectUV = vec2(u, v);
-            closest.intersectedTriangle = triangle; 
-          } 
-        } 
+  }
+}
+
+void printBVHStats() {
+  int triangles = 0, nodes = 0, instances = 0, meshTriangles = 0;
+  for (int o = 0; o < (int)objectBVHs.size(); o++) {
+    triangles += objects[o].FaceCount();
+    if (objects[o].IsInstance()) instances++;
+    else nodes += objectBVHs[o].bvh.nodes.size();
+  }
+  for (map<unsigned long, ObjectBVH>::const_iterator m = meshBVHs.begin(); m != meshBVHs.end(); ++m) {
+    nodes += m->second.bvh.nodes.size();
+    meshTriangles += m->second.faceCount;
+  }
+  const float rays = std::max(1L, frameStats.rays);
+  if (useBVH) {
+    cout << "BVH: " << triangles << " triangles in " << topLevelObjects.size() << " objects, " << nodes << " bottom level nodes, " << topLevelBVH.nodes.size() << " top level nodes\n";
+    cout << "BVH: " << instances << " of the objects are instances of " << meshBVHs.size() << " shared meshes, with " << meshTriangles << " triangles between them\n";
+    cout << "BVH: " << frameStats.objectsBuilt << " objects built, " << frameStats.objectsRefit << " refit, " << frameStats.meshesBuilt << " meshes built, updated in " << (frameStats.updateTime * 1000) << "ms\n";
+    cout << "BVH: leaves tested with the " << triangleBlockKernelName << " triangle block kernel\n";
+  }
+  const float shadowRays = std::max(1L, frameStats.shadowRays);
+  cout << "BVH: " << frameStats.rays << " rays, " << (frameStats.nodesVisited / rays) << " nodes and " << (frameStats.trianglesTested / rays) << " triangles per ray\n";
+  cout << "BVH: " << frameStats.shadowRays << " shadow rays, " << (frameStats.shadowNodesVisited / shadowRays) << " nodes and " << (frameStats.shadowTrianglesTested / shadowRays) << " triangles per ray\n";
+  cout << "BVH: " << frameStats.softShadowPoints << " points sampled the area light, " << (frameStats.softShadowSamples / std::max(1.0f, float(frameStats.softShadowPoints))) << " samples each\n";
+  const float cacheQueries = std::max(1L, frameStats.occluderCacheHits + frameStats.occluderCacheMisses);
+  cout << "BVH: the occluder cache found the blocker for " << frameStats.occluderCacheHits << " shadow rays and missed " << frameStats.occluderCacheMisses << " (" << (100 * frameStats.occluderCacheHits / cacheQueries) << "% hits)\n";
+  cout << "BVH: " << frameStats.shadowRaysAvoided << " shadow queries answered without searching the scene, " << (frameStats.shadowRaysAvoided - frameStats.occluderCacheHits) << " of them for lights culled by the light BVH\n";
+  const float lightQueries = std::max(1L, frameStats.lightQueries);
+  cout << "BVH: " << lights.size() << " lights, " << frameStats.lightQueries << " points shaded with " << (frameStats.lightsShaded / lightQueries) << " of them each, after testing " << (frameStats.lightNodesVisited / lightQueries) << " light BVH nodes\n";
+  const float packets = std::max(1L, frameStats.packets);
+  const float packetRays = std::max(1L, frameStats.packetRays);
+  cout << "BVH: " << frameStats.packetRays << " camera rays in " << frameStats.packets << " packets, " << (frameStats.packetNodesVisited / packets) << " nodes per packet and " << (frameStats.packetTrianglesTested / packetRays) << " triangles per ray\n";
+  cout << "BVH: " << frameStats.singlePrimaryRays << " camera rays traced one at a time\n";
+  cout << "BVH: " << frameStats.recordsReused << " triangle records kept from the last frame, " << frameStats.normalsReused << " face normals read from them instead of being worked out again\n";
+  cout << "BVH: " << frameStats.secondaryRays << " reflected and refracted rays traced, " << frameStats.raysSaved << " not traced as they would add less than " << minimumRayWeight << " to their pixel\n";
+}
+
+// a ray in the space the faces of one object are in - the world for most objects, but the mesh's own space for an
+// instance. the direction isn't normalised again, so a distance along the ray (t) is the same in both spaces
+struct ObjectRay {
+  vec3 point;
+  vec3 direction;
+  vec3 inverseDirection;
+};
+
+ObjectRay objectSpaceRay(int o, vec3 rayPoint, vec3 rayDirection, vec3 inverseDirection) {
+  ObjectRay ray;
+  if (!objects[o].IsInstance()) {
+    ray.point = rayPoint;
+    ray.direction = rayDirection;
+    ray.inverseDirection = inverseDirection;
+    return ray;
+  }
+  ray.point = vec3(objects[o].inverseTransform * vec4(rayPoint, 1));
+  ray.direction = vec3(objects[o].inverseTransform * vec4(rayDirection, 0));
+  ray.inverseDirection = inverseRayDirection(ray.direction);
+  return ray;
+}
+
+// walks the tree of object o, keeping the closest hit - the ray has to be in the object's space already
+void closestHitInObject(int o, const ObjectRay &ray, float &closestT, RayHit &hit) {
+  const ObjectBVH &objectBVH = *bottomLevelBVHs[o];
+  // an instance that overrides its mesh's material can't cull with the mesh's records, so it culls each hit itself
+  const bool cullWithRecords = objects[o].CullsWithRecords();
+  objectBVH.bvh.Traverse(ray.point, ray.inverseDirection, closestT, traversalStats.nodesVisited, [&](int firstFace, int faceCount) {
+    // test the leaf's faces 8 at a time, and then pick the closest of the ones that were hit
+    traversalStats.trianglesTested += faceCount;
+    const int firstBlock = objectBVH.firstBlock[firstFace];
+    const int lastBlock = firstBlock + ((faceCount + TRIANGLE_BLOCK_SIZE - 1) / TRIANGLE_BLOCK_SIZE);
+    for (int b = firstBlock; b < lastBlock; b++) {
+      const TriangleBlock &block = objectBVH.blocks[b];
+      float t[TRIANGLE_BLOCK_SIZE], u[TRIANGLE_BLOCK_SIZE], v[TRIANGLE_BLOCK_SIZE];
+      const int mask = intersectTriangleBlock(block, ray.point, ray.direction, 0, closestT, cullWithRecords, t, u, v);
+      for (int lane = 0; lane < TRIANGLE_BLOCK_SIZE; lane++) {
+        if (!(mask & (1 << lane)) || (t[lane] >= closestT)) continue;
+        const int f = block.faceIndex[lane];
+        if (!cullWithRecords && !objects[o].FacesRay(f, ray.direction)) continue;
+        closestT = t[lane];
+        hit.objectIndex = o;
+        hit.faceIndex = f;
+        hit.t = t[lane];
+        hit.u = u[lane];
+        hit.v = v[lane];
       }
+    }
+    return false;
+  });
+}
+
+// finds the closest face the ray hits and stores it in hit, returning false if it hits nothing
+// with the BVH we walk the top level tree, and then the tree of every object whose box the ray goes through,
+// otherwise we test the bounding box of every object and then each of its faces
+// either way we only keep the closest hit so far, so this never allocates any memory
+bool closestHit(vec3 rayPoint, vec3 rayDirection, RayHit &hit) {
+  traversalStats.rays++;
+  hit = RayHit();
+
+  const vec3 inverseDirection = inverseRayDirection(rayDirection);
+  float closestT = numeric_limits<float>::infinity();
+
+  // tests the faces of object o against the ray, keeping the closest
+  // only the faces that face the ray can be hit (apart from glass), so the faces seen from behind are culled
+  auto testFace = [&](int o, int f, const ObjectRay &ray) {
+    traversalStats.trianglesTested++;
+    float t, u, v;
+    const bool cullWithRecords = objects[o].CullsWithRecords();
+    if (!objects[o].Records()[f].Intersect(ray.point, ray.direction, 0, closestT, cullWithRecords, t, u, v)) return;
+    if (!cullWithRecords && !objects[o].FacesRay(f, ray.direction)) return;
+    closestT = t;
+    hit.objectIndex = o;
+    hit.faceIndex = f;
+    hit.t = t;
+    hit.u = u;
+    hit.v = v;
+  };
+
+  if (useBVH) {
+    topLevelBVH.Traverse(rayPoint, inverseDirection, closestT, traversalStats.nodesVisited, [&](int first, int count) {
+      for (int j = first; j < first + count; j++) {
+        const int o = topLevelObjects[topLevelBVH.indices[j]];
+        closestHitInObject(o, objectSpaceRay(o, rayPoint, rayDirection, inverseDirection), closestT, hit);
+      }
+      return false;
+    });
   }
-  return closest; 
-} 
+  else {
+    for (int o = 0; o < (int)objects.size(); o++) {
+      // if the ray misses the bounding box (or hits it further away than what we already have) none of the faces can be closer
+      float tNear;
+      traversalStats.nodesVisited++;
+      if (!objects[o].boundingBox.Intersects(rayPoint, inverseDirection, 0, closestT, tNear)) continue;
+      const ObjectRay ray = objectSpaceRay(o, rayPoint, rayDirection, inverseDirection);
+      for (int f = 0; f < objects[o].FaceCount(); f++) testFace(o, f, ray);
+    }
+  }
+  return hit.IsHit();
+}
+
+// finds the closest face the ray hits and fills in the full intersection record for shading it
+RayTriangleIntersection closestIntersection(vec3 rayPoint, vec3 rayDirection) {
+  RayHit hit;
+  if (closestHit(rayPoint, rayDirection, hit)) return createIntersection(hit.objectIndex, hit.faceIndex, hit.u, hit.v, rayPoint);
+  RayTriangleIntersection closest;
+  closest.distanceFromCamera = -1; // no intersection
+  return closest;
+}
+
+// checks whether anything blocks the straight line from point to target (normally the light)
+// unlike closestHit, any blocker will do, so we stop at the first opaque face we find without looking for the closest one
+// glass lets light through, so if the only blockers are glass faces we return REFLECTIVE instead of YES
+// light is the number of the light target is on, which picks the occluder cache entry to use
+SHADOW occlusion(vec3 point, vec3 target, int light) {
+  traversalStats.shadowRays++;
+  const vec3 shadowRayDirection = normalize(target - point);
+  const vec3 inverseDirection = inverseRayDirection(shadowRayDirection);
+  float distance = distanceVec3(target, point); // an intersection beyond the light doesn't matter
+  SHADOW result = NO;
+
+  // try the face that blocked the last shadow ray to this light first
+  const bool cached = useOccluderCache && (light >= 0) && (light < OCCLUDER_CACHE_LIGHTS);
+  if (cached) {
+    const int o = occluderCache.objectIndex[light];
+    if (o != -1) {
+      traversalStats.shadowTrianglesTested++;
+      float t, u, v;
+      const ObjectRay ray = objectSpaceRay(o, point, shadowRayDirection, inverseDirection);
+      if (objects[o].Records()[occluderCache.faceIndex[light]].Intersect(ray.point, ray.direction, 0.0001, distance, false, t, u, v)) {
+        traversalStats.occluderCacheHits++;
+        traversalStats.shadowRaysAvoided++;
+        return YES;
+      }
+    }
+    traversalStats.occluderCacheMisses++;
+  }
+  int blockerObject = -1, blockerFace = -1; // the opaque face that blocked the ray, if one did
+
+  // tests face f of object o, returning true if it is an opaque blocker (so the search can stop)
+  auto testFace = [&](int o, int f, const ObjectRay &ray) {
+    traversalStats.shadowTrianglesTested++;
+    float t, u, v;
+    // the intersection has to be past 0.0001 to avoid self-intersection
+    // shadow rays are blocked by both sides of a face, so nothing is culled
+    if (!objects[o].Records()[f].Intersect(ray.point, ray.direction, 0.0001, distance, false, t, u, v)) return false;
+    if (objects[o].FaceMaterial(f) == GLASS) {
+      result = REFLECTIVE;
+      return false;
+    }
+    result = YES;
+    blockerObject = o;
+    blockerFace = f;
+    return true;
+  };
+
+  if (useBVH) {
+    bool blocked = false;
+    topLevelBVH.Traverse(point, inverseDirection, distance, traversalStats.shadowNodesVisited, [&](int first, int count) {
+      for (int j = first; j < first + count; j++) {
+        const int o = topLevelObjects[topLevelBVH.indices[j]];
+        if (!objects[o].castsShadows) continue;
+        const ObjectBVH &objectBVH = *bottomLevelBVHs[o];
+        const ObjectRay ray = objectSpaceRay(o, point, shadowRayDirection, inverseDirection);
+        objectBVH.bvh.Traverse(ray.point, ray.inverseDirection, distance, traversalStats.shadowNodesVisited, [&](int firstFace, int faceCount) {
+          traversalStats.shadowTrianglesTested += faceCount;
+          const int firstBlock = objectBVH.firstBlock[firstFace];
+          const int lastBlock = firstBlock + ((faceCount + TRIANGLE_BLOCK_SIZE - 1) / TRIANGLE_BLOCK_SIZE);
+          for (int b = firstBlock; b < lastBlock; b++) {
+            const TriangleBlock &block = objectBVH.blocks[b];
+            float t[TRIANGLE_BLOCK_SIZE], u[TRIANGLE_BLOCK_SIZE], v[TRIANGLE_BLOCK_SIZE];
+            const int mask = intersectTriangleBlock(block, ray.point, ray.direction, 0.0001, distance, false, t, u, v);
+            for (int lane = 0; lane < TRIANGLE_BLOCK_SIZE; lane++) {
+              if (!(mask & (1 << lane))) continue;
+              // glass lets the light through, so keep looking for something opaque
+              if (objects[o].FaceMaterial(block.faceIndex[lane]) == GLASS) result = REFLECTIVE;
+              else {
+                result = YES;
+                blockerObject = o;
+                blockerFace = block.faceIndex[lane];
+                blocked = true;
+                return true;
+              }
+            }
+          }
+          return false;
+        });
+        if (blocked) return true;
+      }
+      return false;
+    });
+  }
+  else {
+    for (int o = 0; o < (int)objects.size(); o++) {
+      if (!objects[o].castsShadows) continue;
+      // if the shadow ray misses the object's bounding box, it can't hit any of its faces
+      float tNear;
+      traversalStats.shadowNodesVisited++;
+      if (!objects[o].boundingBox.Intersects(point, inverseDirection, 0, distance, tNear)) continue;
+      const ObjectRay ray = objectSpaceRay(o, point, shadowRayDirection, inverseDirection);
+      for (int f = 0; f < objects[o].FaceCount(); f++) {
+        if (testFace(o, f, ray)) break;
+      }
+      if (result == YES) break;
+    }
+  }
+  if (cached && (result == YES)) {
+    occluderCache.objectIndex[light] = blockerObject;
+    occluderCache.faceIndex[light] = blockerFace;
+  }
+  return result;
+}
+
+// with REDNOISE_COUNT_ALLOCATIONS defined (make benchmark) every heap allocation in the program is counted, so
+// benchmarkRays can check the ray queries never allocate - normal builds keep the standard allocator
+#ifdef REDNOISE_COUNT_ALLOCATIONS
+// kept out of line, so the compiler doesn't see new's malloc() paired with delete's free() and warn about it
+#if defined(__GNUC__)
+#define REDNOISE_NOINLINE __attribute__((noinline))
+#else
+#define REDNOISE_NOINLINE
+#endif
+
+std::atomic<long> allocationCount(0);
+
+REDNOISE_NOINLINE void* operator new(std::size_t size) {
+  allocationCount.fetch_add(1, std::memory_order_relaxed);
+  void *pointer = malloc((size > 0) ? size : 1);
+  if (pointer == NULL) throw std::bad_alloc();
+  return pointer;
+}
+
+REDNOISE_NOINLINE void* operator new[](std::size_t size) {
+  return operator new(size);
+}
+
+REDNOISE_NOINLINE void operator delete(void *pointer) noexcept {
+  free(pointer);
+}
+
+REDNOISE_NOINLINE void operator delete[](void *pointer) noexcept {
+  free(pointer);
+}
+
+REDNOISE_NOINLINE void operator delete(void *pointer, std::size_t) noexcept {
+  free(pointer);
+}
+
+REDNOISE_NOINLINE void operator delete[](void *pointer, std::size_t) noexcept {
+  free(pointer);
+}
+#endif
+
+// times closestHit on every primary ray of the frame, and reports how many allocations that took (when they are counted)
+void benchmarkRays() {
+  prepareRaytracer();
+  const int repeats = 5;
+  RayHit hit;
+  long hits = 0;
+
+#ifdef REDNOISE_COUNT_ALLOCATIONS
+  const long allocationsBefore = allocationCount.load();
+#endif
+  std::clock_t start = std::clock();
+  for (int r = 0; r < repeats; r++) {
+    for (int j = 0; j < HEIGHT; j++) {
+      for (int i = 0; i < WIDTH; i++) {
+        if (closestHit(raytracerCamera.position, raytracerCamera.Direction(i, j), hit)) hits++;
+      }
+    }
+  }
+  const double duration = (std::clock() - start) / (double) CLOCKS_PER_SEC;
+
+  const long rays = long(repeats) * WIDTH * HEIGHT;
+  cout << "Benchmark: " << rays << " primary rays (" << hits << " hits) in " << duration << "s - " << (rays / duration / 1000000) << " million rays/s\n";
+#ifdef REDNOISE_COUNT_ALLOCATIONS
+  const long allocations = allocationCount.load() - allocationsBefore;
+  cout << "Benchmark: " << allocations << " allocations, " << (allocations / double(rays)) << " per ray\n";
+#else
+  cout << "Benchmark: allocations aren't counted in this build (make benchmark counts them)\n";
+#endif
+}
  
+//////////////////////////////////////////////////////// 
+// DIRTY REGIONS
+//////////////////////////////////////////////////////// 
+
+// a rectangle on the screen, measured in samples
+struct ScreenRect {
+  vec2 min;
+  vec2 max;
+
+  // an empty rectangle
+  ScreenRect() {
+    min = vec2(std::numeric_limits<float>::infinity());
+    max = vec2(-std::numeric_limits<float>::infinity());
+  }
+
+  ScreenRect(vec2 minCorner, vec2 maxCorner) {
+    min = minCorner;
+    max = maxCorner;
+  }
+
+  bool IsEmpty() const {
+    return (min.x > max.x) || (min.y > max.y);
+  }
+
+  void Expand(vec2 point) {
+    min = glm::min(min, point);
+    max = glm::max(max, point);
+  }
+
+  void Expand(const ScreenRect &rect) {
+    min = glm::min(min, rect.min);
+    max = glm::max(max, rect.max);
+  }
+
+  ScreenRect Intersection(const ScreenRect &rect) const {
+    return ScreenRect(glm::max(min, rect.min), glm::min(max, rect.max));
+  }
+};
+
+// what the last raytraced frame was of, so the next one only has to retrace the parts of the screen that could look
+// different. between them the pixel buffer (and pixelSamples) must only be written by the raytracer
+struct RaytracedFrame {
+  bool valid; // false if there isn't a last frame to build on
+  bool adaptiveAA; // whether the frame filled in pixelSamples
+  Camera camera;
+  vector<Light> lights;
+  vector<unsigned long> versions; // the version of each object
+  vector<BoundingBox> boxes; // the bounding box of each object
+};
+RaytracedFrame lastRaytracedFrame;
+
+// the part of the screen that object o could make look different - the object itself, the shadow it throws from
+// anywhere on any area light that reaches it up to the edges of the scene, and the reflection of both in every mirror face
+// (a mirror object is assumed not to reflect into itself). if some of that is behind the camera the region is the whole screen
+// box is the object's bounding box, which can be where the object was in an earlier frame
+ScreenRect objectRegion(int o, const BoundingBox &box){
+  const ScreenRect wholeScreen(vec2(-std::numeric_limits<float>::infinity()), vec2(std::numeric_limits<float>::infinity()));
+  if (box.IsEmpty()) return ScreenRect();
+
+  // the shadow can only be inside the shape made by the box's corners and where the lines from the lights' corners
+  // through them leave the scene - a light whose reach doesn't get to the box can't light anything behind it either
+  vector<vec3> points;
+  for (int c = 0; c < 8; c++) {
+    const vec3 corner((c & 1) ? box.max.x : box.min.x, (c & 2) ? box.max.y : box.min.y, (c & 4) ? box.max.z : box.min.z);
+    points.push_back(corner);
+    for (int l = 0; l < (int)lights.size(); l++) {
+      if (!lights[l].ReachBox(lightCullThreshold).Overlaps(box)) continue;
+      for (int k = 0; k < 4; k++) {
+        const vec3 lightCorner = lights[l].position + vec3(((k & 1) ? 0.5f : -0.5f) * lights[l].size.x, 0, ((k & 2) ? 0.5f : -0.5f) * lights[l].size.z);
+        points.push_back(corner + (distanceToLeaveScene(corner, corner - lightCorner) * (corner - lightCorner)));
+      }
+    }
+  }
+  const int count = points.size();
+  ScreenRect region;
+  for (int p = 0; p < count; p++) {
+    vec2 sample;
+    if (!raytracerCamera.Project(points[p], sample)) return wholeScreen;
+    region.Expand(sample);
+  }
+
+  for (int m = 0; m < (int)objects.size(); m++) {
+    if (m == o) continue;
+    for (int f = 0; f < objects[m].FaceCount(); f++) {
+      if (objects[m].FaceMaterial(f) != MIRROR) continue;
+      const ModelTriangle face = objects[m].WorldFace(f);
+      ScreenRect faceRect;
+      for (int v = 0; v < 3; v++) {
+        vec2 sample;
+        if (!raytracerCamera.Project(face.vertices[v], sample)) return wholeScreen;
+        faceRect.Expand(sample);
+      }
+      // the reflection in the face's plane, which can only be seen in the face itself
+      const vec3 normal = objects[m].WorldFaceNormal(f);
+      const float offset = dot(normal, face.vertices[0]);
+      ScreenRect reflection;
+      for (int p = 0; p < count; p++) {
+        vec2 sample;
+        if (!raytracerCamera.Project(points[p] - (2 * (dot(normal, points[p]) - offset) * normal), sample)) return wholeScreen;
+        reflection.Expand(sample);
+      }
+      reflection = reflection.Intersection(faceRect);
+      if (!reflection.IsEmpty()) region.Expand(reflection);
+    }
+  }
+  return region;
+}
+
+// works out which tiles of the screen have to be traced again, and returns how many that is - every tile, unless the
+// last frame is there to build on, the camera hasn't moved and only objects that can't change the lighting have
+int findDirtyTiles(vector<bool> &dirtyTiles){
+  const int tileCount = TILES_ACROSS * TILES_DOWN;
+  const RaytracedFrame &last = lastRaytracedFrame;
+  ScreenRect dirty;
+  bool full = !useDirtyRegions || !last.valid || showSamplesPerPixel;
+  full = full || (last.adaptiveAA != (useAdaptiveAA && (AA > 1) && !useWavefront)) || !last.camera.SameView(raytracerCamera);
+  full = full || !findChangedRegion(dirty);
+
+  dirtyTiles.assign(tileCount, full);
+  if (full) return tileCount;
+  if (dirty.IsEmpty()) return 0;
+  int dirtyCount = 0;
+  for (int tile = 0; tile < tileCount; tile++) {
+    const vec2 tileMin(float((tile % TILES_ACROSS) * TILE_SIZE), float((tile / TILES_ACROSS) * TILE_SIZE));
+    const ScreenRect overlap = dirty.Intersection(ScreenRect(tileMin, tileMin + vec2(TILE_SIZE)));
+    dirtyTiles[tile] = !overlap.IsEmpty();
+    dirtyCount += dirtyTiles[tile];
+  }
+  return dirtyCount;
+}
+
+// the part of the screen (as the camera sees it now) that could look different because of the objects that have
+// changed since the last frame, in their old places and their new ones, with dirtyRegionMargin pixels around it
+// returns false if something has changed the lighting of the whole scene
+bool findChangedRegion(ScreenRect &region){
+  const RaytracedFrame &last = lastRaytracedFrame;
+  region = ScreenRect();
+  if ((objects.size() != last.versions.size()) || (last.lights != lights)) return false;
+
+  bool moved = false;
+  int mirrors = 0;
+  for (int o = 0; o < (int)objects.size(); o++) {
+    if (hasMaterial(objects[o], MIRROR)) mirrors++;
+    if (objects[o].version == last.versions[o]) continue;
+    moved = true;
+    // the light, mirrors and glass change how everything else looks
+    if (!objects[o].castsShadows || hasMaterial(objects[o], MIRROR) || hasMaterial(objects[o], GLASS)) return false;
+    region.Expand(objectRegion(o, last.boxes[o]));
+    region.Expand(objectRegion(o, objects[o].boundingBox));
+  }
+  // reflections between mirrors could go anywhere
+  if (mirrors > 1) return false;
+  // anything seen through (or reflected by) glass could have moved
+  for (int o = 0; (o < (int)objects.size()) && moved; o++) {
+    if (hasMaterial(objects[o], GLASS)) region.Expand(objectRegion(o, objects[o].boundingBox));
+  }
+  if (!region.IsEmpty()) {
+    region.min -= vec2(dirtyRegionMargin * AA);
+    region.max += vec2(dirtyRegionMargin * AA);
+  }
+  return true;
+}
+
+// remembers what the frame that has just been raytraced was of
+void recordRaytracedFrame(){
+  RaytracedFrame &frame = lastRaytracedFrame;
+  frame.valid = true;
+  frame.adaptiveAA = useAdaptiveAA && (AA > 1) && !useWavefront;
+  frame.camera = raytracerCamera;
+  frame.lights = lights;
+  frame.versions.resize(objects.size());
+  frame.boxes.resize(objects.size());
+  for (int o = 0; o < (int)objects.size(); o++) {
+    frame.versions[o] = objects[o].version;
+    frame.boxes[o] = objects[o].boundingBox;
+  }
+}
+
+void forgetRaytracedFrame(){
+  lastRaytracedFrame.valid = false;
+}
+
+bool hasMaterial(const Object &object, MATERIAL material){
+  for (int f = 0; f < object.FaceCount(); f++) {
+    if (object.FaceMaterial(f) == material) return true;
+  }
+  return false;
+}
+
+// how many lots of direction the line from point goes before it leaves sceneBox
+float distanceToLeaveScene(vec3 point, vec3 direction){
+  float distance = std::numeric_limits<float>::infinity();
+  for (int i = 0; i < 3; i++) {
+    if (direction[i] > 0) distance = std::min(distance, (sceneBox.max[i] - point[i]) / direction[i]);
+    else if (direction[i] < 0) distance = std::min(distance, (sceneBox.min[i] - point[i]) / direction[i]);
+  }
+  if (distance == std::numeric_limits<float>::infinity()) return 0; // direction is zero
+  return std::max(0.0f, distance);
+}
+
+//////////////////////////////////////////////////////// 
+// TEMPORAL REPROJECTION
+//////////////////////////////////////////////////////// 
+
+// the last frame's pixels, kept while the new frame is traced over them
+vector<PixelSample> previousPixelSamples(W * H);
+vector<uint32_t> previousColours(W * H);
+// the part of the screen where objects have moved, which can't be reused
+ScreenRect temporalChangedRegion;
+
+// checks whether the new frame can reuse the last one, and keeps a copy of it if it can
+bool prepareReprojection(){
+  const RaytracedFrame &last = lastRaytracedFrame;
+  if (!useTemporalReprojection || showSamplesPerPixel || !last.valid || !last.adaptiveAA || last.camera.SameView(raytracerCamera)) return false;
+  if (!findChangedRegion(temporalChangedRegion)) return false;
+  previousPixelSamples = pixelSamples;
+  for (int y = 0; y < H; y++) {
+    for (int x = 0; x < W; x++) previousColours[x + (y * W)] = window.getPixelColour(x, y);
+  }
+  return true;
+}
+
+// finds the last frame's colour for the point the camera ray through sample (i,j) hit. it can only be used if the last
+// frame saw the same object at the same distance there, away from an edge (where its colour would be mixed with
+// something else) and from anything that moved, and if the point looks the same from both cameras - mirrors, glass
+// and shiny highlights change with the angle they're seen from
+bool reprojectedColour(int i, int j, const RayHit &hit, const RayTriangleIntersection &closest, vec3 rayDirection, uint32_t &colour){
+  if (!hit.IsHit()) return false;
+  const vec2 middle(float(i) + 0.5f, float(j) + 0.5f);
+  if (!temporalChangedRegion.IsEmpty() && !temporalChangedRegion.Intersection(ScreenRect(middle, middle)).IsEmpty()) return false;
+  const MATERIAL material = objects[hit.objectIndex].FaceMaterial(hit.faceIndex);
+  if ((material == MIRROR) || (material == GLASS)) return false;
+
+  const RaytracedFrame &last = lastRaytracedFrame;
+  const vec3 point = closest.intersectionPoint;
+  vec2 sample;
+  if (!last.camera.Project(point, sample)) return false;
+  const int x = int(floor(sample.x / AA));
+  const int y = int(floor(sample.y / AA));
+  if ((x < 0) || (y < 0) || (x >= W) || (y >= H)) return false;
+  const PixelSample &previous = previousPixelSamples[x + (y * W)];
+  if ((previous.objectIndex != hit.objectIndex) || (previous.material != material) || previous.supersampled) return false;
+  if (previous.age >= temporalMaxAge) return false;
+  if (std::abs(distanceVec3(point, last.camera.position) - previous.depth) > temporalDepthThreshold * previous.depth) return false;
+
+  // a highlight adding less than one step of colour doesn't matter
+  const vec3 lastRayDirection = normalize(point - last.camera.position);
+  bool highlight = false;
+  forEachLightAt(point, false, [&](int l, float fade) {
+    if ((fade * calculateSpecularLight(point, rayDirection, closest.normal, lights[l]) > 0.01) || (fade * calculateSpecularLight(point, lastRayDirection, closest.normal, lights[l]) > 0.01)) highlight = true;
+  });
+  if (highlight) return false;
+  colour = previousColours[x + (y * W)];
+  pixelSamples[(i / AA) + ((j / AA) * W)].age = previous.age + 1;
+  return true;
+}
+
+//////////////////////////////////////////////////////// 
+// PACKET TRACING
+//////////////////////////////////////////////////////// 
+
+// traces the camera rays for the packet of pixels whose top left corner is (x,y) and colours them in
+// if the rays don't all point into the same octant the boxes can't be tested for the packet as a whole, so the
+// rays are traced one at a time instead (this only happens for packets that straddle the centre lines of the image)
+void tracePrimaryPacket(int x, int y) {
+  const int packetWidth = std::min(PACKET_WIDTH, WIDTH - x);
+  const int packetHeight = std::min(PACKET_WIDTH, HEIGHT - y);
+  const int count = packetWidth * packetHeight;
+  vec3 directions[PACKET_SIZE];
+  for (int j = 0; j < packetHeight; j++) raytracerCamera.RowDirections(x, y + j, packetWidth, &directions[j * packetWidth]);
+
+  if (!sameOctant(directions, count)) {
+    for (int r = 0; r < count; r++) {
+      Colour colour = shootRay(raytracerCamera.position, directions[r], 0, 1); // depth starts at 0, IOR is 1 as travelling in air
+      SetBufferColour(x + (r % packetWidth), y + (r / packetWidth), colour.toUINT32_t());
+    }
+    return;
+  }
+
+  RayHit hits[PACKET_SIZE];
+  closestHitPacket(raytracerCamera.position, directions, count, hits);
+  for (int r = 0; r < count; r++) {
+    RayTriangleIntersection closest;
+    if (hits[r].IsHit()) closest = createIntersection(hits[r].objectIndex, hits[r].faceIndex, hits[r].u, hits[r].v, raytracerCamera.position);
+    else closest.distanceFromCamera = -1; // no intersection
+    Colour colour = shadeIntersection(closest, directions[r], 0, 1);
+    SetBufferColour(x + (r % packetWidth), y + (r / packetWidth), colour.toUINT32_t());
+  }
+}
+
+// tracePixelSample for the screen pixels whose first samples are (x,y), (x + AA, y), ... up to PACKET_WIDTH of them
+// across and down, stopping at xEnd and yEnd
+void tracePixelSamplePacket(int x, int y, int xEnd, int yEnd, bool reuseLastFrame) {
+  const int packetWidth = std::min(PACKET_WIDTH, (xEnd - x + AA - 1) / AA);
+  const int packetHeight = std::min(PACKET_WIDTH, (yEnd - y + AA - 1) / AA);
+  const int count = packetWidth * packetHeight;
+  vec3 directions[PACKET_SIZE];
+  for (int j = 0; j < packetHeight; j++) raytracerCamera.RowDirections(x, y + (j * AA), packetWidth, &directions[j * packetWidth], AA);
+
+  RayHit hits[PACKET_SIZE];
+  if (sameOctant(directions, count)) closestHitPacket(raytracerCamera.position, directions, count, hits);
+  else {
+    // as in tracePrimaryPacket, the boxes can't be tested for the packet as a whole
+    traversalStats.singlePrimaryRays += count;
+    for (int r = 0; r < count; r++) closestHit(raytracerCamera.position, directions[r], hits[r]);
+  }
+  for (int r = 0; r < count; r++) finishPixelSample(x + ((r % packetWidth) * AA), y + ((r / packetWidth) * AA), hits[r], directions[r], reuseLastFrame);
+}
+
+// true if every direction has the same sign as the first one on each axis
+bool sameOctant(const vec3 *directions, int count) {
+  for (int r = 1; r < count; r++) {
+    for (int i = 0; i < 3; i++) {
+      if ((directions[r][i] < 0) != (directions[0][i] < 0)) return false;
+    }
+  }
+  return true;
+}
+
+// the packet version of closestHit, for count (at most PACKET_SIZE) rays that start at rayPoint and all point into the
+// same octant. the packet walks the trees together, testing each box once for all the rays, and each leaf it reaches
+// is tested against every ray with the triangle block kernel. an instance's tree is in its mesh's space, where the rays
+// may not share an octant any more, so each ray goes down it on its own
+void closestHitPacket(vec3 rayPoint, const vec3 *rayDirections, int count, RayHit *hits) {
+  traversalStats.packets++;
+  traversalStats.packetRays += count;
+
+  // the range of 1/direction over the packet, for the interval slab test
+  float closestT[PACKET_SIZE];
+  vec3 inverseMin(numeric_limits<float>::infinity());
+  vec3 inverseMax(-numeric_limits<float>::infinity());
+  for (int r = 0; r < count; r++) {
+    hits[r] = RayHit();
+    closestT[r] = numeric_limits<float>::infinity();
+    const vec3 inverseDirection = inverseRayDirection(rayDirections[r]);
+    inverseMin = glm::min(inverseMin, inverseDirection);
+    inverseMax = glm::max(inverseMax, inverseDirection);
+  }
+  // nothing past the furthest of the closest hits can matter to any ray in the packet
+  float packetMaxT = numeric_limits<float>::infinity();
+
+  topLevelBVH.TraversePacket(rayPoint, inverseMin, inverseMax, packetMaxT, traversalStats.packetNodesVisited, [&](int first, int objectCount) {
+    for (int j = first; j < first + objectCount; j++) {
+      const int o = topLevelObjects[topLevelBVH.indices[j]];
+      if (objects[o].IsInstance()) {
+        for (int r = 0; r < count; r++) {
+          closestHitInObject(o, objectSpaceRay(o, rayPoint, rayDirections[r], inverseRayDirection(rayDirections[r])), closestT[r], hits[r]);
+        }
+        packetMaxT = closestT[0];
+        for (int r = 1; r < count; r++) packetMaxT = std::max(packetMaxT, closestT[r]);
+        continue;
+      }
+      const ObjectBVH &objectBVH = objectBVHs[o];
+      objectBVH.bvh.TraversePacket(rayPoint, inverseMin, inverseMax, packetMaxT, traversalStats.packetNodesVisited, [&](int firstFace, int faceCount) {
+        traversalStats.packetTrianglesTested += faceCount * count;
+        const int firstBlock = objectBVH.firstBlock[firstFace];
+        const int lastBlock = firstBlock + ((faceCount + TRIANGLE_BLOCK_SIZE - 1) / TRIANGLE_BLOCK_SIZE);
+        for (int b = firstBlock; b < lastBlock; b++) {
+          const TriangleBlock &block = objectBVH.blocks[b];
+          for (int r = 0; r < count; r++) {
+            float t[TRIANGLE_BLOCK_SIZE], u[TRIANGLE_BLOCK_SIZE], v[TRIANGLE_BLOCK_SIZE];
+            const int mask = intersectTriangleBlock(block, rayPoint, rayDirections[r], 0, closestT[r], true, t, u, v);
+            for (int lane = 0; lane < TRIANGLE_BLOCK_SIZE; lane++) {
+              if (!(mask & (1 << lane)) || (t[lane] >= closestT[r])) continue;
+              const int f = block.faceIndex[lane];
+              closestT[r] = t[lane];
+              hits[r].objectIndex = o;
+              hits[r].faceIndex = f;
+              hits[r].t = t[lane];
+              hits[r].u = u[lane];
+              hits[r].v = v[lane];
+            }
+          }
+        }
+        packetMaxT = closestT[0];
+        for (int r = 1; r < count; r++) packetMaxT = std::max(packetMaxT, closestT[r]);
+        return false;
+      });
+    }
+    return false;
+  });
+}
+
 //////////////////////////////////////////////////////// 
 // LIGHTING 
 //////////////////////////////////////////////////////// 
  
-// rayPoint is the point in which this ray starts (normalls camera, but could be an intersection point if recursed)
+// makes every group called "light" in the scene an area light, at the middle of the group's box and the same size
+// (the MTL files have no emissive colours, so the name is the only way to tell) - their own faces don't cast shadows
+void loadLights() {
+  lights.clear();
+  for (int o = 0; o < (int)objects.size(); o++) {
+    if (objects[o].name != "light") continue;
+    const vec3 size = objects[o].boundingBox.GetSize();
+    lights.push_back(Light(objects[o].boundingBox.GetCentre(), vec3(size.x, 0, size.z), lightIntensity));
+    objects[o].castsShadows = false;
+    objects[o].isLight = true;
+  }
+}
+
+// the lights are put in a tree by the box around where each one is brighter than lightCullThreshold, so a point only
+// has to look at the lights whose boxes it is in - the cost grows with the lights near the point, not all of them
+BVH lightBVH;
+
+void buildLightBVH() {
+  vector<BoundingBox> reachBoxes(lights.size());
+  const float threshold = std::max(lightCullThreshold, 1e-6f);
+  for (int l = 0; l < (int)lights.size(); l++) reachBoxes[l] = lights[l].ReachBox(threshold);
+  lightBVH.Build(reachBoxes);
+}
+
+// calls lightFunction(l, fade) for every light l that gives point more than lightCullThreshold of diffuse light
+// the specular light doesn't get dimmer with distance, so to stop it ending in a hard edge where the light is culled,
+// each light fades out (fade goes from 1 to 0) as its drop off goes from twice lightCullThreshold down to it
+// countStats is only set by the shading in surfaceColour, so the other lookups (like the highlight check
+// before reusing last frame's colour) don't count as shading points or as shadow rays avoided
+template <typename LightFunction>
+void forEachLightAt(vec3 point, bool countStats, LightFunction lightFunction) {
+  long nodesVisited = 0;
+  int shaded = 0;
+  lightBVH.TraversePoint(point, nodesVisited, [&](int first, int count) {
+    for (int k = first; k < first + count; k++) {
+      const int l = lightBVH.indices[k];
+      const float dropOff = intensityDropOff(point, lights[l]);
+      if (dropOff <= lightCullThreshold) continue;
+      shaded++;
+      lightFunction(l, (lightCullThreshold > 0) ? std::min(1.0f, (dropOff - lightCullThreshold) / lightCullThreshold) : 1.0f);
+    }
+    return false;
+  });
+  if (!countStats) return;
+  traversalStats.lightQueries++;
+  traversalStats.lightNodesVisited += nodesVisited;
+  traversalStats.lightsShaded += shaded;
+  // every light that was culled is a light whose shadow didn't have to be looked for
+  traversalStats.shadowRaysAvoided += (long)lights.size() - shaded;
+}
+
+// a ray in the tree of reflections and refractions that starts at a pixel, waiting to be traced
+// weight is how much of its colour makes it back to the pixel (the product of the Fresnel factors on the way there)
+struct RayTask {
+  vec3 rayPoint;
+  vec3 rayDirection;
+  int depth;
+  float currentIOR;
+  float weight;
+};
+
+// a hit adds at most two rays (for glass) one level deeper, and the newest ray is always traced first - so the stack
+// holds at most one ray waiting on each level, plus the one just added
+const int RAY_STACK_SIZE = maximumNumberOfReflections + 1;
+
+struct RayStack {
+  RayTask tasks[RAY_STACK_SIZE];
+  int size;
+
+  RayStack() {
+    size = 0;
+  }
+
+  void Push(vec3 rayPoint, vec3 rayDirection, int depth, float currentIOR, float weight) {
+    RayTask &task = tasks[size++];
+    task.rayPoint = rayPoint;
+    task.rayDirection = rayDirection;
+    task.depth = depth;
+    task.currentIOR = currentIOR;
+    task.weight = weight;
+  }
+};
+
+// rayPoint is the point in which this ray starts (normally the camera)
 // rayDirection is the direction of the ray
-// depth coutns how many recursions we have done (this happens when there are reflections) - it starts at 0 when rays are shot from camera
+// depth counts how many reflections the ray has already been through - it starts at 0 when rays are shot from camera
 // currentIOR stores the index of refraction of the current medium we are in (air is 1 - glass is 1.5)
 Colour shootRay(vec3 rayPoint, vec3 rayDirection, int depth, float currentIOR){ 
-  // cull the faces
-  backfaceCulling(rayDirection);
-  // stop recursing if our reflections get too much
+  // stop tracing if our reflections get too much
   if (depth == maximumNumberOfReflections) return Colour(255,255,255);  
+  if (depth == 0) traversalStats.singlePrimaryRays++;
 
-  // does this ray intersect any of the faces?
-  vector<vector<vec4>> solutions = checkForIntersections(rayPoint, rayDirection); 
-  // find the closest intersection
-  RayTriangleIntersection closest = closestIntersection(solutions, rayPoint); 
-  Colour colour = closest.intersectedTriangle.colour; 
-  vec3 point = closest.intersectionPoint; 
- 
-  // if this ray doesn't intersect anything, then we return the colour black 
-  if (closest.distanceFromCamera <= 0) return Colour(0,0,0); 
-  
-  // the ambient, diffuse and specular light constants 
-  float Ka = 0.2, Kd = 0.4, Ks = 0.4; 
- 
-  ModelTriangle triangle = closest.intersectedTriangle;
+  // find the closest intersection - either by walking the BVH or by testing every face
+  RayTriangleIntersection closest = closestIntersection(rayPoint, rayDirection);
+  return shadeIntersection(closest, rayDirection, depth, currentIOR);
+}
+
+// works out the colour seen along a ray (going in rayDirection) whose closest intersection is closest - split off
+// from shootRay so the packet tracer can find the intersections for a whole packet first
+// mirrors and glass don't have a colour of their own: they push the rays they reflect and refract onto a stack, with
+// how much each one contributes, and we trace those here until the whole tree is done (rather than recursing)
+Colour shadeIntersection(const RayTriangleIntersection &closest, vec3 rayDirection, int depth, float currentIOR){
+  RayStack rays;
+  vec3 total(0, 0, 0);
+  addRayColour(closest, rayDirection, depth, currentIOR, 1, rays, total);
+  while (rays.size > 0) {
+    RayTask ray = rays.tasks[--rays.size];
+    // stop tracing if our reflections get too much
+    if (ray.depth == maximumNumberOfReflections) {
+      total += ray.weight * vec3(255, 255, 255);
+      continue;
+    }
+    if (!keepRay(ray)) continue;
+    const RayTriangleIntersection hit = closestIntersection(ray.rayPoint, ray.rayDirection);
+    addRayColour(hit, ray.rayDirection, ray.depth, ray.currentIOR, ray.weight, rays, total);
+  }
+  return Colour(int(total.r), int(total.g), int(total.b));
+}
+
+// a ray that can only make a tiny difference to the pixel isn't worth tracing, along with everything it would spawn
+// with Russian roulette we still trace a few of them (the lower the weight, the fewer), scaled up to make up for the rest
+bool keepRay(RayTask &ray){
+  if (ray.weight < minimumRayWeight) {
+    if (!useRussianRoulette || (rayRandom(ray) * minimumRayWeight >= ray.weight)) {
+      traversalStats.raysSaved++;
+      return false;
+    }
+    ray.weight = minimumRayWeight;
+  }
+  traversalStats.secondaryRays++;
+  return true;
+}
+
+// a number between 0 and 1 made from the bits of the ray, so that Russian roulette makes the same choices every
+// time the frame is rendered, whichever thread traces the ray
+float rayRandom(const RayTask &ray){
+  return hashRandom(ray.rayPoint, ray.rayDirection);
+}
 
-  // if this face is a mirror, create a reflected ray and shoot this ray (recurse this function) 
-  if (triangle.material == MIRROR){ 
+// a number between 0 and 1 that looks random, but is always the same for the same a and b
+float hashRandom(vec3 a, vec3 b){
+  float values[6] = {a.x, a.y, a.z, b.x, b.y, b.z};
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < 6; i++) {
+    uint32_t bits;
+    memcpy(&bits, &values[i], sizeof(bits));
+    hash = (hash ^ bits) * 16777619u;
+  }
+  // mix the bits up so that nearby inputs get unrelated numbers
+  hash ^= hash >> 16;
+  hash *= 0x7feb352du;
+  hash ^= hash >> 15;
+  hash *= 0x846ca68bu;
+  hash ^= hash >> 16;
+  return (hash >> 8) / 16777216.0f;
+}
+
+// adds weight times the colour of the surface the ray hit to total - or for mirrors and glass, pushes the rays that carry on
+void addRayColour(const RayTriangleIntersection &closest, vec3 rayDirection, int depth, float currentIOR, float weight, RayStack &rays, vec3 &total){
+  // if this ray doesn't intersect anything, then it adds black
+  if (closest.distanceFromCamera <= 0) return;
+
+  const MATERIAL material = objects[closest.objectIndex].FaceMaterial(closest.faceIndex);
+  // if this face is a mirror, create a reflected ray and carry on with that
+  if (material == MIRROR){ 
     vec3 incident = rayDirection; 
-    vec3 normal = closest.intersectedTriangle.getNormal(); 
+    vec3 normal = closest.faceNormal; 
+    if (!objects[closest.objectIndex].IsInstance()) traversalStats.normalsReused++;
     vec3 reflection = normalize(incident - (2 * dot(incident, normal) * normal));
     // avoid self-intersection 
-    return shootRay(point + ((float)0.00001 * normal), reflection, depth + 1, currentIOR);
+    rays.Push(closest.intersectionPoint + ((float)0.00001 * normal), reflection, depth + 1, currentIOR, weight);
   } 
-  else if (triangle.material == GLASS){
-    return glass(rayDirection, closest, depth);
+  else if (material == GLASS){
+    glass(rayDirection, closest, depth, weight, rays);
+  }
+  else {
+    const Colour colour = surfaceColour(closest, rayDirection);
+    total += weight * vec3(colour.red, colour.green, colour.blue);
   }
-  else if (triangle.material == TEXTURE) {
-    const vec2 e0 = closest.intersectedTriangle.vertices_textures[1] - closest.intersectedTriangle.vertices_textures[0];
-    const vec2 e1 = closest.intersectedTriangle.vertices_textures[2] - closest.intersectedTriangle.vertices_textures[0];
+}
+
+// the colour of a face that isn't a mirror or glass, lit by the light (and shadowed)
+Colour surfaceColour(const RayTriangleIntersection &closest, vec3 rayDirection){
+  const ModelTriangle &triangle = hitTriangle(closest);
+  const MATERIAL material = objects[closest.objectIndex].FaceMaterial(closest.faceIndex);
+  Colour colour = objects[closest.objectIndex].FaceColour(closest.faceIndex); 
+  vec3 point = closest.intersectionPoint; 
+ 
+  // the ambient, diffuse and specular light constants 
+  float Ka = 0.2, Kd = 0.4, Ks = 0.4; 
+
+  // a light gives out light rather than being lit, so it is just its own colour
+  if (objects[closest.objectIndex].isLight) return colour;
+
+  if (material == TEXTURE) {
+    const vec2 e0 = triangle.vertices_textures[1] - triangle.vertices_textures[0];
+    const vec2 e1 = triangle.vertices_textures[2] - triangle.vertices_textures[0];
 
-    const vec2 texture_point = closest.intersectedTriangle.vertices_textures[0] + (closest.intersectUV[0] * e0) + (closest.intersectUV[1] * e1);
+    const vec2 texture_point = triangle.vertices_textures[0] + (closest.intersectUV[0] * e0) + (closest.intersectUV[1] * e1);
 
     // std::cout << closest_point[0] << " , " << closest_point[1] << std::endl;
     const float x = texture_point.x * textureFile.width;
@@ -1417,15 +2878,30 @@ Colour shootRay(vec3 rayPoint, vec3 rayDirection, int depth, float currentIOR){
     return getImageFilePixelColour(&textureFile, x, y);
   }
 
-  else if (triangle.material == BUMP) {
+  // add up the light from every light that is bright enough here to matter, and how much of it is in shadow
+  // (weighted by how bright each light is here)
+  float diffuse = 0, specular = 0, shadowed = 0, brightness = 0;
+  forEachLightAt(point, true, [&](int l, float fade) {
+    const Light &light = lights[l];
+    const float dropOff = fade * intensityDropOff(point, light);
+    diffuse += dropOff * angleOfIncidence(closest, light);
+    // closest.normal - this is the interpolated normal for Phong shading (it is previously calculated and stored in the RayTriangleIntersection object) 
+    specular += fade * calculateSpecularLight(point, rayDirection, closest.normal, light);
+    // a point that can see the middle of an area light can still be at the edge of a shadow, so with
+    // softShadowsFromLitPoints every point samples it - otherwise only the points the middle can't see do
+    if (softShadowsFromLitPoints && light.IsArea()) shadowed += dropOff * softShadows(closest, l);
+    else if (InShadow(point, l) != NO) shadowed += dropOff * softShadows(closest, l);
+    brightness += dropOff;
+  });
+
+  if (material == BUMP) {
 
   }
   // else we use Phong shading to get the colour
   else {
-    Kd *= (intensityDropOff(point) * angleOfIncidence(closest)); // multiply Kd by the diffuse intensity.
+    Kd *= diffuse; // multiply Kd by the diffuse intensity.
     // specular light 
-    // closest.normal - this is the interpolated normal for Phong shading (it is previously calculated and stored in the RayTriangleIntersection object) 
-    Ks *= calculateSpecularLight(point, rayDirection, closest.normal); // multiply Ks by the specular intensity.
+    Ks *= specular; // multiply Ks by the specular intensity.
     colour = getFinalColour(colour, Ka, Kd, Ks);
   }
  
@@ -1446,8 +2922,8 @@ Colour shootRay(vec3 rayPoint, vec3 rayDirection, int depth, float currentIOR){
  
   // CODE FOR SOFT SHADOWS
 
-  if (InShadow(closest.intersectionPoint) == YES || InShadow(closest.intersectionPoint) == REFLECTIVE){
-    const float shadowFraction = softShadows(closest);
+  if (shadowed > 0){
+    const float shadowFraction = shadowed / brightness;
     // mix shadow and normal colour
     Colour shadowColour = getFinalColour(colour, Ka/2, 0, 0); //getFinalColour(Colour, Ka, Kd, Ks)
 
@@ -1459,27 +2935,28 @@ Colour shootRay(vec3 rayPoint, vec3 rayDirection, int depth, float currentIOR){
   return colour;
 } 
  
-Colour getFinalColour(Colour colour, float Ka, float Kd, float Ks){ 
+Colour getFinalColour(const Colour &colour, float Ka, float Kd, float Ks){ 
   // this takes the ambient, diffuse and specular constants and gets the output colour 
   // note that we do not multiply the specular light by the colour (it is white hence the 255) 
-  colour.SetRed(((Ka + Kd) * colour.red) + (Ks * 255));
-  colour.SetGreen(((Ka + Kd) * colour.green) + (Ks * 255)); 
-  colour.SetBlue(((Ka + Kd) * colour.blue) + (Ks * 255));
-  return colour; 
+  // (the Colour constructor clamps each channel to 0-255, and leaves out the name so no string is copied)
+  const int r = ((Ka + Kd) * colour.red) + (Ks * 255);
+  const int g = ((Ka + Kd) * colour.green) + (Ks * 255);
+  const int b = ((Ka + Kd) * colour.blue) + (Ks * 255);
+  return Colour(r, g, b); 
 } 
  
 // given a point in the scene, this function calculates the intensity of the light 
-float intensityDropOff(const vec3 point){ 
-  const float distance = distanceVec3(point, lightPosition); 
-  return lightIntensity / (2 * 3.1416 * distance * distance); //return intensity 
+float intensityDropOff(const vec3 point, const Light &light){ 
+  const float distance = distanceVec3(point, light.position); 
+  return light.intensity / (2 * 3.1416 * distance * distance); //return intensity 
 } 
 
 // this function takes an intersection point and calculates the angle of incidence and 
 // outputs an intensity value between 0 and 1 
-float angleOfIncidence(RayTriangleIntersection intersection){ 
-  ModelTriangle triangle = intersection.intersectedTriangle; 
-  vec3 normal = triangle.getNormal(); 
-  vec3 vectorToLight = lightPosition - intersection.intersectionPoint; 
+float angleOfIncidence(const RayTriangleIntersection &intersection, const Light &light){ 
+  vec3 normal = intersection.faceNormal; 
+  if (!objects[intersection.objectIndex].IsInstance()) traversalStats.normalsReused++;
+  vec3 vectorToLight = light.position - intersection.intersectionPoint; 
   vectorToLight = normalize(vectorToLight); 
   float intensity = dot(normal, vectorToLight); 
   // the dot product returns 1 if they are parallel 
@@ -1498,42 +2975,13 @@ float distanceVec3(const vec3 from, const vec3 to){
 } 
  
 // this returns a true or false depending on if we are in shadow or not 
-SHADOW InShadow(vec3 point){ 
-  const vec3 shadowRayDirection = normalize(lightPosition - point);
-  const float distance = distanceVec3(lightPosition, point); 
-  for (int o=0; o<objects.size(); o++) {
-    // for each face, send a 'shadow ray' from the point to the light and check for intersections 
-    for (int i = 0 ; i < objects[o].faces.size(); i++){ 
-      ModelTriangle triangle = objects[o].faces[i]; 
-        
-      // got the following code from the worksheet 
-      vec3 e0 = triangle.vertices[1] - triangle.vertices[0]; 
-      vec3 e1 = triangle.vertices[2] - triangle.vertices[0]; 
-      vec3 SPVector = point - triangle.vertices[0]; 
-      mat3 DEMatrix(-shadowRayDirection, e0, e1); 
-      vec3 possibleSolution = glm::inverse(DEMatrix) * SPVector; // this is a 1x3 vector of (t,u,v) (look at notes) 
-      const float t = possibleSolution[0]; 
-      const float u = possibleSolution[1]; 
-      const float v = possibleSolution[2]; 
-        
-      // if it is actually a solution 
-      bool bool1 = (t > 0.0001); // this is not 0 to avoid self-intersection 
-      bool bool2 = (0 <= u) && (u <= 1) && (0 <= v) && (v <= 1) && ((u + v) <= 1); 
-      bool bool3 = (t < distance); // an intersection beyond the light doesn't matter 
-      // if we have an intersection then we can stop checking the other faces 
-      // it is 0.000001 to avoid self intersection 
-      if (bool1 && bool2 && bool3) {
-        if (triangle.material == GLASS) return REFLECTIVE;
-        else return YES; 
-      }
-    } 
-  }
-  return NO; 
+SHADOW InShadow(vec3 point, int light){ 
+  return occlusion(point, lights[light].position, light);
 } 
 
-float calculateSpecularLight(vec3 point, vec3 rayDirection, vec3 normal){ 
+float calculateSpecularLight(vec3 point, vec3 rayDirection, vec3 normal, const Light &light){ 
   // got the method from the lecture slides 
-  vec3 lightDirection = point - lightPosition; 
+  vec3 lightDirection = point - light.position; 
   vec3 incident = normalize(lightDirection); 
   normal = normalize(normal); 
   // equation form online 
@@ -1546,83 +2994,109 @@ float calculateSpecularLight(vec3 point, vec3 rayDirection, vec3 normal){
   return intensity; 
 } 
  
-float softShadows(RayTriangleIntersection intersection){
-  ///////////////////
-  // PARAMETERS
-  ///////////////////
-  float gradientConstant = 0.5; // how big the gradient should be
-  int numberOfSteps = 50; // how smooth it should be
-  ///////////////////
-
-  vec3 normal = intersection.intersectedTriangle.getNormal();
-  vec3 point = intersection.intersectionPoint;
-  vec3 up = gradientConstant * normal;
-  vec3 pointAbove = point + up;
-  vec3 pointBelow = point;//point + down;
-
-  // Total Light.
-  if ((InShadow(pointAbove) == NO) && (InShadow(pointBelow) == NO)) return 0;
-  // Total Shadow.
-  else if ((InShadow(pointAbove) == YES) && (InShadow(pointBelow) == YES)) return 1;
-  // Reflective Surface.
-  else if ((InShadow(pointAbove) == REFLECTIVE) || (InShadow(pointBelow) == REFLECTIVE)) return 0.08;
-  // Somewhere in-between total light and total shadow.
-  else {
-    vec3 upVector = pointAbove - pointBelow;
-    for (int i = 1 ; i <= numberOfSteps ; i++){
-      vec3 point = pointBelow + ((i / (float)numberOfSteps) * upVector);
-      // the first point will definitely be in shadow and as we move up we find how in shadow it should be
-      if (InShadow(point) == NO) return (i / (float)numberOfSteps); //shadowFraction = (i / (float)numberOfSteps)
+// how much of area light number 'light' the point can't see, from 0 (all of it) to 1 (none of it)
+// the light is split into a softShadowGrid x softShadowGrid grid with one shadow ray to a random point in each cell
+// (stratified sampling), so the cost is fixed. glass only blocks a little of the light, so a sample through glass counts as 0.08
+// with adaptiveSoftShadows the four corner cells go first, and if they all agree the point is taken to be fully in or
+// out of the light without tracing the rest
+// a point light is all in one place, so it only needs the one shadow ray
+// the samples behind the face the point is on can't light it whatever is in the way (angleOfIncidence already dims
+// the light that comes in at a slant), so they are left out rather than counted as blocked by the face itself
+float softShadows(const RayTriangleIntersection &intersection, int light){
+  const vec3 point = intersection.intersectionPoint;
+  const int grid = lights[light].IsArea() ? std::max(1, softShadowGrid) : 1;
+  const int samples = grid * grid;
+  traversalStats.softShadowPoints++;
+  const float lightSide = dot(lights[light].position - point, intersection.faceNormal);
+
+  float shadowFraction = 0;
+  int tested = 0;
+  // traces the shadow ray to a point in cell, unless it is behind the face
+  auto sampleCell = [&](int cell) -> SHADOW {
+    const vec3 sample = areaLightSample(point, cell, grid, lights[light]);
+    if ((dot(sample - point, intersection.faceNormal) * lightSide) < 0) return NO;
+    tested++;
+    const SHADOW shadow = occlusion(point, sample, light);
+    if (shadow == YES) shadowFraction += 1;
+    else if (shadow == REFLECTIVE) shadowFraction += 0.08;
+    return shadow;
+  };
+
+  const int corners[4] = {0, grid - 1, samples - grid, samples - 1};
+  const int cornerCount = (grid > 1) ? 4 : 1;
+  int blocked = 0, glassy = 0;
+  for (int k = 0; k < cornerCount; k++) {
+    const SHADOW shadow = sampleCell(corners[k]);
+    if (shadow == YES) blocked++;
+    else if (shadow == REFLECTIVE) glassy++;
+  }
+  const int cornersTested = tested;
+  const bool agree = (blocked == cornersTested) || (glassy == cornersTested) || (blocked + glassy == 0);
+  if (!(adaptiveSoftShadows && agree) && (cornerCount < samples)) {
+    for (int cell = 0; cell < samples; cell++) {
+      if ((cell == corners[0]) || (cell == corners[1]) || (cell == corners[2]) || (cell == corners[3])) continue;
+      sampleCell(cell);
     }
   }
-  return 0; //return shadowFraction
+  traversalStats.softShadowSamples += tested;
+  return (tested > 0) ? shadowFraction / tested : 0;
 } 
 
+// a point in cell number 'cell' of the area light (split into a grid x grid grid), placed at random within the cell
+// the random numbers come from the shading point, so every frame picks the same samples
+vec3 areaLightSample(vec3 point, int cell, int grid, const Light &light){
+  const int i = cell % grid;
+  const int j = cell / grid;
+  const float u = (i + hashRandom(point, vec3(i, j, 0))) / grid;
+  const float v = (j + hashRandom(point, vec3(i, j, 1))) / grid;
+  return light.position + vec3((u - 0.5f) * light.size.x, 0, (v - 0.5f) * light.size.z);
+}
 
 void gouraudShading() { 
 } 
 
-Colour glass(vec3 rayDirection, RayTriangleIntersection closest, int depth){
+// glass reflects some of the light and refracts the rest, so both rays go on the stack - the Fresnel equation decides
+// how much of the weight each one gets
+void glass(vec3 rayDirection, const RayTriangleIntersection &closest, int depth, float weight, RayStack &rays){
   vec3 point = closest.intersectionPoint;
-  ModelTriangle triangle = closest.intersectedTriangle;
-  vec3 normal = triangle.getNormal();
+  vec3 normal = closest.faceNormal;
+  if (!objects[closest.objectIndex].IsInstance()) traversalStats.normalsReused++;
 
-  // send the reflection ray
+  // the reflection ray
   vec3 incident = rayDirection; 
   vec3 reflection = incident - (2 * dot(incident, normal) * normal); 
   reflection = normalize(reflection); 
-  vec3 newPoint = point + ((float)0.00001 * normal); // avoid self-intersection 
-  Colour reflectionColour = shootRay(newPoint, reflection, depth + 1, 1); // IOR back to 1 as moving in air
+  vec3 reflectionPoint = point + ((float)0.00001 * normal); // avoid self-intersection 
   
-  // send the refraction ray
+  // the refraction ray
   float refractiveIndex = 1.3;
   vec4 refraction = refract(incident, normal, refractiveIndex);
   int direction = refraction[3];
   
   vec3 refracted (refraction[0], refraction[1], refraction[2]);
-  if (refracted == vec3 (0,0,0)) return reflectionColour;
-  
+  // total internal reflection, so all the light is reflected
+  if (refracted == vec3 (0,0,0)) {
+    rays.Push(reflectionPoint, reflection, depth + 1, 1, weight); // IOR back to 1 as moving in air
+    return;
+  }
 
   // we need to adjust the point to avoid self-intersection but this depends on if we are going through the face or reflecting from it
+  vec3 refractionPoint;
   if (direction == -1){
     // we are entering a new material
-    newPoint = point - ((float)0.0001 * normal);
+    refractionPoint = point - ((float)0.0001 * normal);
   }
   else {
     // we are leaving the material
-    newPoint = point + ((float)0.0001 * normal);
+    refractionPoint = point + ((float)0.0001 * normal);
   }
-  Colour refractionColour = shootRay(newPoint, refracted, depth + 1, 1.5); // IOR is 1.5 as now we are travelling in glass
 
   // mix them together using Fresnel equation
   float reflectiveConstant = fresnel(rayDirection, normal, refractiveIndex);
   float refractiveConstant = 1 - reflectiveConstant;
 
-  Colour output;
-  output.SetRed ((reflectiveConstant * reflectionColour.red) + (refractiveConstant * refractionColour.red));
-  output.SetGreen ((reflectiveConstant * reflectionColour.green) + (refractiveConstant * refractionColour.green));
-  output.SetBlue ((reflectiveConstant * reflectionColour.blue) + (refractiveConstant * refractionColour.blue));
-  return output;
+  rays.Push(reflectionPoint, reflection, depth + 1, 1, weight * reflectiveConstant); // IOR back to 1 as moving in air
+  rays.Push(refractionPoint, refracted, depth + 1, 1.5, weight * refractiveConstant); // IOR is 1.5 as now we are travelling in glass
 }
 
 // calculates the direction of the refraction
@@ -1674,29 +3148,174 @@ float fresnel(vec3 incident, vec3 normal, float ior) {
 
 
 
-////////////////////
-// CULLING CODE
-////////////////////
 
 
-// we cull the faces in the scene that face away from the camera
-// we do this by taking vectors from the camera to the centre of each face and dotting it with the normal
-void backfaceCulling(vec3 rayDirection){
-  // for each object
-  for (int o = 0 ; o < objects.size() ; o++){
-      // for each face
-      for (int i = 0 ; i < objects[o].faces.size() ; i++){
-        //ModelTriangle face = objects[o].faces[i];
-        const vec3 normal = objects[o].faces[i].getNormal();
-        //True if faces face the other way && !glass.
-        objects[o].faces[i].culled = ((dot(normal, rayDirection) > 0) && (objects[o].faces[i].material != GLASS));
-      }
+
+//////////////////////////////////////////////////////// 
+// WAVEFRONT TRACING
+//////////////////////////////////////////////////////// 
+
+// in wavefront mode a tile is traced one bounce at a time - all of its camera rays, then all the rays they reflect and
+// refract, and so on. each wave is sorted so that rays going the same way from nearby points are traced one after
+// the other, and the hits are shaded grouped by material, so each step works on the same code and the same part of
+// the scene for as long as possible
+
+// a ray in a wave, along with the pixel of the tile its colour is added to
+struct WavefrontRay {
+  RayTask ray;
+  int pixel;
+  int sequence; // the order the rays were added to the wave, to break ties when sorting so the result is always the same
+  uint64_t sortKey;
+};
+
+// each thread keeps its own buffers, so they only need allocating for the first few tiles
+struct WavefrontBuffers {
+  vector<WavefrontRay> rays;
+  vector<WavefrontRay> nextRays;
+  vector<RayHit> hits;
+  vector<int> order; // the order the hits are shaded in
+  vector<vec3> colours; // the colour of each pixel in the tile so far
+};
+thread_local WavefrontBuffers wavefrontBuffers;
+
+// spreads the bottom 10 bits of v out so there are two zero bits between each of them
+uint32_t spreadBits(uint32_t v) {
+  v &= 0x3ff;
+  v = (v | (v << 16)) & 0x030000ff;
+  v = (v | (v << 8)) & 0x0300f00f;
+  v = (v | (v << 4)) & 0x030c30c3;
+  v = (v | (v << 2)) & 0x09249249;
+  return v;
+}
+
+// rays are sorted by the octant they point into, and then along a Morton (Z order) curve through sceneBox by where they start
+uint64_t wavefrontSortKey(const RayTask &ray) {
+  const uint64_t octant = ((ray.rayDirection.x < 0) ? 1 : 0) | ((ray.rayDirection.y < 0) ? 2 : 0) | ((ray.rayDirection.z < 0) ? 4 : 0);
+  const vec3 size = sceneBox.GetSize();
+  uint32_t morton = 0;
+  for (int i = 0; i < 3; i++) {
+    const float position = (size[i] > 0) ? ((ray.rayPoint[i] - sceneBox.min[i]) / size[i]) : 0;
+    const uint32_t cell = std::min(1023, std::max(0, int(position * 1024)));
+    morton |= spreadBits(cell) << i;
   }
+  return (octant << 30) | morton;
 }
 
+// renders the tile whose top left corner is pixel (x,y) a wave at a time
+void renderTileWavefront(int x, int y) {
+  WavefrontBuffers &buffers = wavefrontBuffers;
+  const int tileWidth = std::min(TILE_SIZE, WIDTH - x);
+  const int tileHeight = std::min(TILE_SIZE, HEIGHT - y);
+  buffers.colours.assign(tileWidth * tileHeight, vec3(0, 0, 0));
+
+  // the camera rays go in a packet at a time, so they can be traced as packets
+  buffers.rays.clear();
+  for (int py = 0; py < tileHeight; py += PACKET_WIDTH) {
+    for (int px = 0; px < tileWidth; px += PACKET_WIDTH) {
+      for (int j = py; j < std::min(py + PACKET_WIDTH, tileHeight); j++) {
+        vec3 rowDirections[PACKET_WIDTH];
+        raytracerCamera.RowDirections(x + px, y + j, std::min(PACKET_WIDTH, tileWidth - px), rowDirections);
+        for (int i = px; i < std::min(px + PACKET_WIDTH, tileWidth); i++) {
+          WavefrontRay ray;
+          ray.ray.rayPoint = raytracerCamera.position;
+          ray.ray.rayDirection = rowDirections[i - px];
+          ray.ray.depth = 0;
+          ray.ray.currentIOR = 1; // IOR is 1 as travelling in air
+          ray.ray.weight = 1;
+          ray.pixel = (j * tileWidth) + i;
+          ray.sequence = buffers.rays.size();
+          buffers.rays.push_back(ray);
+        }
+      }
+    }
+  }
 
+  while (!buffers.rays.empty()) {
+    traceWave(buffers);
+    shadeWave(buffers);
+    buffers.rays.swap(buffers.nextRays);
+  }
 
+  for (int p = 0; p < tileWidth * tileHeight; p++) {
+    const vec3 &total = buffers.colours[p];
+    SetBufferColour(x + (p % tileWidth), y + (p / tileWidth), Colour(int(total.r), int(total.g), int(total.b)).toUINT32_t());
+  }
+}
+
+// sorts the wave and finds the closest hit for each of its rays
+// runs of rays that start at the same point and go into the same octant (like the camera rays) are traced as packets
+void traceWave(WavefrontBuffers &buffers) {
+  vector<WavefrontRay> &rays = buffers.rays;
+  const int count = rays.size();
+  for (int i = 0; i < count; i++) rays[i].sortKey = wavefrontSortKey(rays[i].ray);
+  std::sort(rays.begin(), rays.end(), [](const WavefrontRay &a, const WavefrontRay &b) {
+    return (a.sortKey < b.sortKey) || ((a.sortKey == b.sortKey) && (a.sequence < b.sequence));
+  });
+
+  buffers.hits.resize(count);
+  const bool packets = useBVH && usePacketTracing;
+  int first = 0;
+  while (first < count) {
+    const RayTask &ray = rays[first].ray;
+    int end = first + 1;
+    if (packets) {
+      while ((end < count) && (end - first < PACKET_SIZE) && (rays[end].ray.rayPoint == ray.rayPoint) && ((rays[end].sortKey >> 30) == (rays[first].sortKey >> 30))) end++;
+    }
+    if (end - first > 1) {
+      vec3 directions[PACKET_SIZE];
+      for (int i = first; i < end; i++) directions[i - first] = rays[i].ray.rayDirection;
+      closestHitPacket(ray.rayPoint, directions, end - first, &buffers.hits[first]);
+    }
+    else {
+      if (ray.depth == 0) traversalStats.singlePrimaryRays++;
+      closestHit(ray.rayPoint, ray.rayDirection, buffers.hits[first]);
+    }
+    first = end;
+  }
+}
 
+// shades the hits grouped by material - the surfaces add their colour to their pixels, and the rays that mirrors and
+// glass send on make up the next wave
+void shadeWave(WavefrontBuffers &buffers) {
+  const vector<WavefrontRay> &rays = buffers.rays;
+  const vector<RayHit> &hits = buffers.hits;
+  const int count = rays.size();
+
+  // rays that missed everything add black, so they don't need shading at all
+  buffers.order.clear();
+  for (int i = 0; i < count; i++) {
+    if (hits[i].IsHit()) buffers.order.push_back(i);
+  }
+  std::sort(buffers.order.begin(), buffers.order.end(), [&](int a, int b) {
+    const MATERIAL materialA = objects[hits[a].objectIndex].FaceMaterial(hits[a].faceIndex);
+    const MATERIAL materialB = objects[hits[b].objectIndex].FaceMaterial(hits[b].faceIndex);
+    return (materialA < materialB) || ((materialA == materialB) && (a < b));
+  });
+
+  buffers.nextRays.clear();
+  for (int k = 0; k < (int)buffers.order.size(); k++) {
+    const int i = buffers.order[k];
+    const WavefrontRay &ray = rays[i];
+    const RayHit &hit = hits[i];
+    const RayTriangleIntersection closest = createIntersection(hit.objectIndex, hit.faceIndex, hit.u, hit.v, ray.ray.rayPoint);
+    RayStack spawned;
+    addRayColour(closest, ray.ray.rayDirection, ray.ray.depth, ray.ray.currentIOR, ray.ray.weight, spawned, buffers.colours[ray.pixel]);
+
+    for (int s = 0; s < spawned.size; s++) {
+      WavefrontRay next;
+      next.ray = spawned.tasks[s];
+      // stop tracing if our reflections get too much
+      if (next.ray.depth == maximumNumberOfReflections) {
+        buffers.colours[ray.pixel] += next.ray.weight * vec3(255, 255, 255);
+        continue;
+      }
+      if (!keepRay(next.ray)) continue;
+      next.pixel = ray.pixel;
+      next.sequence = buffers.nextRays.size();
+      buffers.nextRays.push_back(next);
+    }
+  }
+}
 
 ////////////////////////////////
 // ANIMATION CODE
@@ -1797,11 +3416,10 @@ void squash(int objectIndex, float squashFactor){
   vec3 averagedVertices (0,0,0);
 
   // for each face
-  for (int i = 0 ; i < object.faces.size() ; i++){
-    ModelTriangle face = object.faces[i];
+  for (int i = 0 ; i < object.FaceCount() ; i++){
     // for each vertex
     for (int j = 0 ; j < 3 ; j++){
-      vec3 vertex = face.vertices[j];
+      vec3 vertex = object.WorldVertex(i, j);
       averagedVertices = averagedVertices + vertex;
       
       if (vertex[1] < lowestPoint){
@@ -1810,7 +3428,7 @@ void squash(int objectIndex, float squashFactor){
     }
   }
 
-  averagedVertices /= float(object.faces.size() * 3);
+  averagedVertices /= float(object.FaceCount() * 3);
 
   // we squash the object around the following point (the centre but on the under side of the object)
   vec3 squashCentre = averagedVertices;
@@ -1818,6 +3436,10 @@ void squash(int objectIndex, float squashFactor){
 
   // for a squash we want to make the object flatter but also wider
   // make the y coordinates closer to the centre but the x and z coordinates further away from the centre
+  if (object.IsInstance()) {
+    objects[objectIndex].Transform(Object::AboutPoint(Object::Scaling(vec3(1 + squashFactor, 1 - squashFactor, 1 + squashFactor)), squashCentre));
+    return;
+  }
   // for each face
   for (int i = 0 ; i < object.faces.size() ; i++){
     // for each vertex
@@ -1830,6 +3452,7 @@ void squash(int objectIndex, float squashFactor){
       objects[objectIndex].faces[i].vertices[j] = newPoint;
     }
   }
+  objects[objectIndex].MarkChanged();
 }
 
 // same function as the jump except we include a squash and stretch transformation with the vertices
@@ -0,0 +1,191 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#ifndef VECTOR_H
+#define VECTOR_H
+#include <vector>
+#endif
+
+#ifndef DEQUE_H
+#define DEQUE_H
+#include <deque>
+#endif
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+// a pool of threads that stay alive between frames, used by the raytracer to render tiles in parallel.
+// Run hands out the tasks in contiguous runs (so each thread starts with a patch of neighbouring tiles), and a thread
+// that runs out of its own tasks steals from the back of another thread's queue. the thread that calls Run works as
+// worker 0, so a pool of n threads only starts n - 1 of its own.
+
+// what one worker did during the last Run
+struct WorkerStats {
+  int tasksRun;
+  int tasksStolen; // how many of tasksRun were taken from another worker's queue
+  double busyTime; // seconds spent running tasks
+};
+
+class ThreadPool {
+  public:
+    double runTime; // seconds the last Run took from start to finish
+
+    ThreadPool() {
+      runTime = 0;
+      stopping = false;
+      generation = 0;
+      remaining = 0;
+    }
+
+    ~ThreadPool() {
+      Stop();
+    }
+
+    // starts threadCount workers, or one for each core if threadCount is 0
+    void Start(int threadCount) {
+      Stop();
+      if (threadCount <= 0) threadCount = std::thread::hardware_concurrency();
+      if (threadCount <= 0) threadCount = 1;
+
+      unsigned long startGeneration;
+      {
+        std::lock_guard<std::mutex> lock(stateMutex);
+        stopping = false;
+        startGeneration = generation;
+      }
+      for (int w = 0; w < threadCount; w++) workers.push_back(new Worker());
+      // the new threads wait for the next Run, however long they take to start
+      for (int w = 1; w < threadCount; w++) threads.push_back(std::thread(&ThreadPool::WorkerLoop, this, w, startGeneration));
+    }
+
+    void Stop() {
+      {
+        std::lock_guard<std::mutex> lock(stateMutex);
+        stopping = true;
+      }
+      wake.notify_all();
+      for (int i = 0; i < (int)threads.size(); i++) threads[i].join();
+      threads.clear();
+      for (int w = 0; w < (int)workers.size(); w++) delete workers[w];
+      workers.clear();
+    }
+
+    int Size() const {
+      return workers.size();
+    }
+
+    // calls task(i, worker) for every i from 0 to taskCount - 1, spread over the workers, and returns once they are all done
+    // worker is the number (0 to Size() - 1) of the thread running the task, so tasks can keep per-thread results
+    void Run(int taskCount, std::function<void(int, int)> task) {
+      if (workers.empty()) Start(0);
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+      job = task;
+      remaining = taskCount;
+      const int workerCount = workers.size();
+      for (int w = 0; w < workerCount; w++) {
+        Worker &worker = *workers[w];
+        std::lock_guard<std::mutex> lock(worker.queueMutex);
+        worker.tasks.clear();
+        for (int i = (w * taskCount) / workerCount; i < ((w + 1) * taskCount) / workerCount; i++) worker.tasks.push_back(i);
+        worker.stats = WorkerStats();
+      }
+      {
+        std::lock_guard<std::mutex> lock(stateMutex);
+        generation++;
+      }
+      wake.notify_all();
+
+      Work(0);
+      {
+        std::unique_lock<std::mutex> lock(stateMutex);
+        done.wait(lock, [this]() { return remaining == 0; });
+      }
+      runTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    WorkerStats GetWorkerStats(int w) const {
+      std::lock_guard<std::mutex> lock(workers[w]->queueMutex);
+      return workers[w]->stats;
+    }
+
+  private:
+    struct Worker {
+      std::mutex queueMutex; // guards tasks and stats
+      std::deque<int> tasks;
+      WorkerStats stats;
+    };
+
+    std::vector<Worker *> workers;
+    std::vector<std::thread> threads;
+    std::function<void(int, int)> job;
+    std::atomic<int> remaining; // tasks of the current Run that haven't finished yet
+
+    // generation goes up by one for every Run, which is how the waiting workers know there is new work
+    std::mutex stateMutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    unsigned long generation;
+    bool stopping;
+
+    void WorkerLoop(int w, unsigned long seen) {
+      while (true) {
+        {
+          std::unique_lock<std::mutex> lock(stateMutex);
+          wake.wait(lock, [&]() { return stopping || (generation != seen); });
+          if (stopping) return;
+          seen = generation;
+        }
+        Work(w);
+      }
+    }
+
+    // runs tasks until there are none left in any queue
+    void Work(int w) {
+      Worker &worker = *workers[w];
+      int task;
+      bool stolen;
+      while (NextTask(w, task, stolen)) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        job(task, w);
+        {
+          // a worker still finishing the last Run can pick up a task of the next one while Run is resetting the stats
+          std::lock_guard<std::mutex> lock(worker.queueMutex);
+          worker.stats.busyTime += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+          worker.stats.tasksRun++;
+          if (stolen) worker.stats.tasksStolen++;
+        }
+        if (--remaining == 0) {
+          std::lock_guard<std::mutex> lock(stateMutex);
+          done.notify_all();
+        }
+      }
+    }
+
+    // takes the next task from the front of this worker's queue, or steals one from the back of someone else's
+    bool NextTask(int w, int &task, bool &stolen) {
+      const int workerCount = workers.size();
+      for (int i = 0; i < workerCount; i++) {
+        Worker &victim = *workers[(w + i) % workerCount];
+        std::lock_guard<std::mutex> lock(victim.queueMutex);
+        if (victim.tasks.empty()) continue;
+        if (i == 0) {
+          task = victim.tasks.front();
+          victim.tasks.pop_front();
+        }
+        else {
+          task = victim.tasks.back();
+          victim.tasks.pop_back();
+        }
+        stolen = (i != 0);
+        return true;
+      }
+      return false;
+    }
+};
+
+#endif
@@ -0,0 +1,185 @@
+#ifndef TRIANGLEBLOCK_H
+#define TRIANGLEBLOCK_H
+
+#include <TriangleRecord.h>
+
+// the SIMD kernels are only built for x86 with GCC or clang - everything else uses the scalar kernel
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TRIANGLEBLOCK_X86
+#include <immintrin.h>
+#endif
+
+// the raytracer's BVH leaves store their triangles in blocks of 8, laid out as a structure of arrays so one ray can be
+// tested against all 8 triangles at once. only the numbers the intersection test needs are stored here (the colours,
+// normals, texture coordinates etc. stay in the ModelTriangles), so the blocks are small and sit next to each other in memory.
+
+const int TRIANGLE_BLOCK_SIZE = 8;
+
+struct TriangleBlock {
+  float v0[3][TRIANGLE_BLOCK_SIZE]; // v0[axis][lane]
+  float e0[3][TRIANGLE_BLOCK_SIZE];
+  float e1[3][TRIANGLE_BLOCK_SIZE];
+  int faceIndex[TRIANGLE_BLOCK_SIZE]; // -1 for an empty lane - its edges are zero so it can never be hit
+  int oneSidedMask; // bit 'lane' is set if that triangle is one sided (see TriangleRecord::oneSided)
+};
+
+void clearTriangleBlock(TriangleBlock &block) {
+  for (int lane = 0; lane < TRIANGLE_BLOCK_SIZE; lane++) {
+    for (int axis = 0; axis < 3; axis++) {
+      block.v0[axis][lane] = 0;
+      block.e0[axis][lane] = 0;
+      block.e1[axis][lane] = 0;
+    }
+    block.faceIndex[lane] = -1;
+  }
+  block.oneSidedMask = 0;
+}
+
+void setTriangleBlockLane(TriangleBlock &block, int lane, const TriangleRecord &record, int faceIndex) {
+  for (int axis = 0; axis < 3; axis++) {
+    block.v0[axis][lane] = record.v0[axis];
+    block.e0[axis][lane] = record.e0[axis];
+    block.e1[axis][lane] = record.e1[axis];
+  }
+  block.faceIndex[lane] = faceIndex;
+  if (record.oneSided) block.oneSidedMask |= (1 << lane);
+  else block.oneSidedMask &= ~(1 << lane);
+}
+
+// all the kernels do the same Moller-Trumbore test as TriangleRecord::Intersect, on every lane of the block.
+// they write t, u and v for each lane and return a bit mask with bit 'lane' set for each triangle hit inside (tMin, tMax)
+// with cullBackFaces, the one sided triangles hit from behind are left out of the mask
+typedef int (*TriangleBlockKernel)(const TriangleBlock &block, glm::vec3 origin, glm::vec3 direction, float tMin, float tMax, bool cullBackFaces, float *t, float *u, float *v);
+
+int intersectTriangleBlockScalar(const TriangleBlock &block, glm::vec3 origin, glm::vec3 direction, float tMin, float tMax, bool cullBackFaces, float *t, float *u, float *v) {
+  int mask = 0;
+  TriangleRecord record;
+  for (int lane = 0; lane < TRIANGLE_BLOCK_SIZE; lane++) {
+    record.v0 = glm::vec3(block.v0[0][lane], block.v0[1][lane], block.v0[2][lane]);
+    record.e0 = glm::vec3(block.e0[0][lane], block.e0[1][lane], block.e0[2][lane]);
+    record.e1 = glm::vec3(block.e1[0][lane], block.e1[1][lane], block.e1[2][lane]);
+    record.oneSided = (block.oneSidedMask & (1 << lane)) != 0;
+    if (record.Intersect(origin, direction, tMin, tMax, cullBackFaces, t[lane], u[lane], v[lane])) mask |= (1 << lane);
+  }
+  return mask;
+}
+
+#ifdef TRIANGLEBLOCK_X86
+
+// 4 lanes at a time, so the block takes two passes
+__attribute__((target("sse2")))
+int intersectTriangleBlockSSE(const TriangleBlock &block, glm::vec3 origin, glm::vec3 direction, float tMin, float tMax, bool cullBackFaces, float *t, float *u, float *v) {
+  const __m128 dx = _mm_set1_ps(direction.x), dy = _mm_set1_ps(direction.y), dz = _mm_set1_ps(direction.z);
+  const __m128 ox = _mm_set1_ps(origin.x), oy = _mm_set1_ps(origin.y), oz = _mm_set1_ps(origin.z);
+  const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1);
+  const __m128 epsilon = _mm_set1_ps(1e-12f), signBit = _mm_set1_ps(-0.0f);
+  const __m128 minimum = _mm_set1_ps(tMin), maximum = _mm_set1_ps(tMax);
+  int mask = 0;
+
+  for (int half = 0; half < TRIANGLE_BLOCK_SIZE; half += 4) {
+    const __m128 e0x = _mm_loadu_ps(&block.e0[0][half]), e0y = _mm_loadu_ps(&block.e0[1][half]), e0z = _mm_loadu_ps(&block.e0[2][half]);
+    const __m128 e1x = _mm_loadu_ps(&block.e1[0][half]), e1y = _mm_loadu_ps(&block.e1[1][half]), e1z = _mm_loadu_ps(&block.e1[2][half]);
+
+    // p = cross(direction, e1)
+    const __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e1z), _mm_mul_ps(dz, e1y));
+    const __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e1x), _mm_mul_ps(dx, e1z));
+    const __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e1y), _mm_mul_ps(dy, e1x));
+    const __m128 determinant = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e0x, px), _mm_mul_ps(e0y, py)), _mm_mul_ps(e0z, pz));
+    const __m128 inverseDeterminant = _mm_div_ps(one, determinant);
+
+    // s = origin - v0
+    const __m128 sx = _mm_sub_ps(ox, _mm_loadu_ps(&block.v0[0][half]));
+    const __m128 sy = _mm_sub_ps(oy, _mm_loadu_ps(&block.v0[1][half]));
+    const __m128 sz = _mm_sub_ps(oz, _mm_loadu_ps(&block.v0[2][half]));
+    const __m128 uu = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz)), inverseDeterminant);
+
+    // q = cross(s, e0)
+    const __m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e0z), _mm_mul_ps(sz, e0y));
+    const __m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e0x), _mm_mul_ps(sx, e0z));
+    const __m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e0y), _mm_mul_ps(sy, e0x));
+    const __m128 vv = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), inverseDeterminant);
+    const __m128 tt = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, qx), _mm_mul_ps(e1y, qy)), _mm_mul_ps(e1z, qz)), inverseDeterminant);
+
+    __m128 hit = _mm_cmpgt_ps(_mm_andnot_ps(signBit, determinant), epsilon);
+    hit = _mm_and_ps(hit, _mm_cmpge_ps(uu, zero));
+    hit = _mm_and_ps(hit, _mm_cmple_ps(uu, one));
+    hit = _mm_and_ps(hit, _mm_cmpge_ps(vv, zero));
+    hit = _mm_and_ps(hit, _mm_cmple_ps(_mm_add_ps(uu, vv), one));
+    hit = _mm_and_ps(hit, _mm_cmpgt_ps(tt, minimum));
+    hit = _mm_and_ps(hit, _mm_cmplt_ps(tt, maximum));
+
+    _mm_storeu_ps(&t[half], tt);
+    _mm_storeu_ps(&u[half], uu);
+    _mm_storeu_ps(&v[half], vv);
+    mask |= _mm_movemask_ps(hit) << half;
+    // the sign bits of the determinants are set where the ray hits the back of the triangle
+    if (cullBackFaces) mask &= ~((_mm_movemask_ps(determinant) << half) & block.oneSidedMask);
+  }
+  return mask;
+}
+
+// all 8 lanes in one pass, using fused multiply-adds for the dot and cross products
+__attribute__((target("avx2,fma")))
+int intersectTriangleBlockAVX2(const TriangleBlock &block, glm::vec3 origin, glm::vec3 direction, float tMin, float tMax, bool cullBackFaces, float *t, float *u, float *v) {
+  const __m256 dx = _mm256_set1_ps(direction.x), dy = _mm256_set1_ps(direction.y), dz = _mm256_set1_ps(direction.z);
+  const __m256 e0x = _mm256_loadu_ps(block.e0[0]), e0y = _mm256_loadu_ps(block.e0[1]), e0z = _mm256_loadu_ps(block.e0[2]);
+  const __m256 e1x = _mm256_loadu_ps(block.e1[0]), e1y = _mm256_loadu_ps(block.e1[1]), e1z = _mm256_loadu_ps(block.e1[2]);
+  const __m256 one = _mm256_set1_ps(1);
+
+  // p = cross(direction, e1)
+  const __m256 px = _mm256_fmsub_ps(dy, e1z, _mm256_mul_ps(dz, e1y));
+  const __m256 py = _mm256_fmsub_ps(dz, e1x, _mm256_mul_ps(dx, e1z));
+  const __m256 pz = _mm256_fmsub_ps(dx, e1y, _mm256_mul_ps(dy, e1x));
+  const __m256 determinant = _mm256_fmadd_ps(e0x, px, _mm256_fmadd_ps(e0y, py, _mm256_mul_ps(e0z, pz)));
+  const __m256 inverseDeterminant = _mm256_div_ps(one, determinant);
+
+  // s = origin - v0
+  const __m256 sx = _mm256_sub_ps(_mm256_set1_ps(origin.x), _mm256_loadu_ps(block.v0[0]));
+  const __m256 sy = _mm256_sub_ps(_mm256_set1_ps(origin.y), _mm256_loadu_ps(block.v0[1]));
+  const __m256 sz = _mm256_sub_ps(_mm256_set1_ps(origin.z), _mm256_loadu_ps(block.v0[2]));
+  const __m256 uu = _mm256_mul_ps(_mm256_fmadd_ps(sx, px, _mm256_fmadd_ps(sy, py, _mm256_mul_ps(sz, pz))), inverseDeterminant);
+
+  // q = cross(s, e0)
+  const __m256 qx = _mm256_fmsub_ps(sy, e0z, _mm256_mul_ps(sz, e0y));
+  const __m256 qy = _mm256_fmsub_ps(sz, e0x, _mm256_mul_ps(sx, e0z));
+  const __m256 qz = _mm256_fmsub_ps(sx, e0y, _mm256_mul_ps(sy, e0x));
+  const __m256 vv = _mm256_mul_ps(_mm256_fmadd_ps(dx, qx, _mm256_fmadd_ps(dy, qy, _mm256_mul_ps(dz, qz))), inverseDeterminant);
+  const __m256 tt = _mm256_mul_ps(_mm256_fmadd_ps(e1x, qx, _mm256_fmadd_ps(e1y, qy, _mm256_mul_ps(e1z, qz))), inverseDeterminant);
+
+  const __m256 zero = _mm256_setzero_ps();
+  __m256 hit = _mm256_cmp_ps(_mm256_andnot_ps(_mm256_set1_ps(-0.0f), determinant), _mm256_set1_ps(1e-12f), _CMP_GT_OQ);
+  hit = _mm256_and_ps(hit, _mm256_cmp_ps(uu, zero, _CMP_GE_OQ));
+  hit = _mm256_and_ps(hit, _mm256_cmp_ps(uu, one, _CMP_LE_OQ));
+  hit = _mm256_and_ps(hit, _mm256_cmp_ps(vv, zero, _CMP_GE_OQ));
+  hit = _mm256_and_ps(hit, _mm256_cmp_ps(_mm256_add_ps(uu, vv), one, _CMP_LE_OQ));
+  hit = _mm256_and_ps(hit, _mm256_cmp_ps(tt, _mm256_set1_ps(tMin), _CMP_GT_OQ));
+  hit = _mm256_and_ps(hit, _mm256_cmp_ps(tt, _mm256_set1_ps(tMax), _CMP_LT_OQ));
+
+  _mm256_storeu_ps(t, tt);
+  _mm256_storeu_ps(u, uu);
+  _mm256_storeu_ps(v, vv);
+  // the sign bits of the determinants are set where the ray hits the back of the triangle
+  if (cullBackFaces) return _mm256_movemask_ps(hit) & ~(_mm256_movemask_ps(determinant) & block.oneSidedMask);
+  return _mm256_movemask_ps(hit);
+}
+
+#endif
+
+// picks the widest kernel this CPU can run, and stores its name for the stats
+TriangleBlockKernel chooseTriangleBlockKernel(const char *&name) {
+#ifdef TRIANGLEBLOCK_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    name = "AVX2";
+    return intersectTriangleBlockAVX2;
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    name = "SSE";
+    return intersectTriangleBlockSSE;
+  }
+#endif
+  name = "scalar";
+  return intersectTriangleBlockScalar;
+}
+
+#endif
@@ -0,0 +1,92 @@
+#ifndef BOUNDINGBOX_H
+#define BOUNDINGBOX_H
+
+#include <glm/glm.hpp>
+#include <limits>
+
+// an axis-aligned bounding box, stored as its minimum and maximum corners
+class BoundingBox {
+  public:
+    glm::vec3 min;
+    glm::vec3 max;
+
+    // an empty box - expanding it by any point gives a box around just that point
+    BoundingBox() {
+      min = glm::vec3(std::numeric_limits<float>::infinity());
+      max = glm::vec3(-std::numeric_limits<float>::infinity());
+    }
+
+    BoundingBox(glm::vec3 minCorner, glm::vec3 maxCorner) {
+      min = minCorner;
+      max = maxCorner;
+    }
+
+    bool IsEmpty() const {
+      return (min.x > max.x) || (min.y > max.y) || (min.z > max.z);
+    }
+
+    void Expand(glm::vec3 point) {
+      min = glm::min(min, point);
+      max = glm::max(max, point);
+    }
+
+    void Expand(const BoundingBox &box) {
+      min = glm::min(min, box.min);
+      max = glm::max(max, box.max);
+    }
+
+    glm::vec3 GetCentre() const {
+      return 0.5f * (min + max);
+    }
+
+    glm::vec3 GetSize() const {
+      return max - min;
+    }
+
+    bool Contains(glm::vec3 point) const {
+      return (point.x >= min.x) && (point.y >= min.y) && (point.z >= min.z) && (point.x <= max.x) && (point.y <= max.y) && (point.z <= max.z);
+    }
+
+    bool Overlaps(const BoundingBox &box) const {
+      return (box.max.x >= min.x) && (box.max.y >= min.y) && (box.max.z >= min.z) && (box.min.x <= max.x) && (box.min.y <= max.y) && (box.min.z <= max.z);
+    }
+
+    // used by the surface area heuristic - the chance of a random ray hitting a box is proportional to its surface area
+    float SurfaceArea() const {
+      if (IsEmpty()) return 0;
+      const glm::vec3 d = max - min;
+      return 2 * ((d.x * d.y) + (d.y * d.z) + (d.z * d.x));
+    }
+
+    // slab test - inverseDirection is 1/rayDirection per component (precomputed once per ray)
+    // returns true if the ray hits the box between tMin and tMax, and stores the entry distance in tNear
+    bool Intersects(glm::vec3 origin, glm::vec3 inverseDirection, float tMin, float tMax, float &tNear) const {
+      const glm::vec3 t0 = (min - origin) * inverseDirection;
+      const glm::vec3 t1 = (max - origin) * inverseDirection;
+      const glm::vec3 tSmall = glm::min(t0, t1);
+      const glm::vec3 tBig = glm::max(t0, t1);
+      tNear = glm::max(glm::max(tSmall.x, tSmall.y), glm::max(tSmall.z, tMin));
+      const float tFar = glm::min(glm::min(tBig.x, tBig.y), glm::min(tBig.z, tMax));
+      return tNear <= tFar;
+    }
+
+    // slab test for a bundle of rays from the same origin, using interval arithmetic - inverseMin and inverseMax are the
+    // smallest and largest 1/direction of the rays per component, and must have the same sign (the rays all point into
+    // the same octant). returns false only if every ray in the bundle misses the box, storing a lower bound of where
+    // they enter it in tNear
+    bool IntersectsInterval(glm::vec3 origin, glm::vec3 inverseMin, glm::vec3 inverseMax, float tMin, float tMax, float &tNear) const {
+      tNear = tMin;
+      float tFar = tMax;
+      for (int i = 0; i < 3; i++) {
+        // a ray going in the negative direction enters through the max side
+        const bool negative = inverseMin[i] < 0;
+        const float enter = (negative ? max[i] : min[i]) - origin[i];
+        const float leave = (negative ? min[i] : max[i]) - origin[i];
+        tNear = glm::max(tNear, glm::min(enter * inverseMin[i], enter * inverseMax[i]));
+        tFar = glm::min(tFar, glm::max(leave * inverseMin[i], leave * inverseMax[i]));
+      }
+      return tNear <= tFar;
+    }
+};
+
+#endif
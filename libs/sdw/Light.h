@@ -0,0 +1,52 @@
+#ifndef LIGHT_H
+#define LIGHT_H
+
+#include <glm/glm.hpp>
+#include <cmath>
+#include <BoundingBox.h>
+
+// a light for the raytracer - either a point, or a flat rectangle (size.x by size.z, centred on position) that the
+// soft shadows take their samples from. either way the light falls off as intensity / (2 pi distance^2) from position
+class Light {
+  public:
+    glm::vec3 position;
+    glm::vec3 size; // (0,0,0) for a point light
+    float intensity;
+
+    Light() {
+      position = glm::vec3(0, 0, 0);
+      size = glm::vec3(0, 0, 0);
+      intensity = 0;
+    }
+
+    Light(glm::vec3 lightPosition, glm::vec3 lightSize, float lightIntensity) {
+      position = lightPosition;
+      size = lightSize;
+      intensity = lightIntensity;
+    }
+
+    bool IsArea() const {
+      return (size.x > 0) || (size.z > 0);
+    }
+
+    // how far from position the light still gives more than threshold (which has to be more than 0)
+    float Reach(float threshold) const {
+      return std::sqrt(intensity / (2 * 3.1416 * threshold));
+    }
+
+    // the box around everywhere the light gives more than threshold
+    BoundingBox ReachBox(float threshold) const {
+      const glm::vec3 reach(Reach(threshold));
+      return BoundingBox(position - reach, position + reach);
+    }
+
+    bool operator==(const Light &other) const {
+      return (position == other.position) && (size == other.size) && (intensity == other.intensity);
+    }
+
+    bool operator!=(const Light &other) const {
+      return !(*this == other);
+    }
+};
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef MESH_H
+#define MESH_H
+
+#include <glm/glm.hpp>
+
+#ifndef VECTOR_H
+  #define VECTOR_H
+  #include <vector>
+#endif
+
+#ifndef MODELTRIANGLE_H
+  #define MODELTRIANGLE_H
+  #include <ModelTriangle.h>
+#endif
+
+#include <BoundingBox.h>
+#include <TriangleRecord.h>
+
+// geometry that any number of objects can share - an instance (see Object::mesh) only stores the transform that puts
+// the mesh in the world, so a hundred copies of the logo keep one set of faces and triangle records between them.
+// a mesh never changes once it is made (it is only ever handed out as a shared_ptr<const Mesh>), so an instance keeps
+// its own colour and material on the Object instead
+class Mesh {
+  public:
+    std::vector<ModelTriangle> faces; // in the mesh's own space
+    std::vector<TriangleRecord> triangleRecords; // the same as Object::triangleRecords, but worked out once for good
+    BoundingBox boundingBox;
+    glm::vec3 centre; // the average of the middles of the faces, like Object::GetCentre
+    unsigned long id; // never used by another mesh, so the raytracer can keep one tree per mesh
+
+    Mesh(const std::vector<ModelTriangle> &meshFaces) {
+      static unsigned long lastId = 0;
+      id = ++lastId;
+      faces = meshFaces;
+      triangleRecords.resize(faces.size());
+      centre = glm::vec3(0, 0, 0);
+      for (int i = 0; i < (int)faces.size(); i++) {
+        triangleRecords[i] = TriangleRecord(faces[i]);
+        for (int j = 0; j < 3; j++) boundingBox.Expand(faces[i].vertices[j]);
+        centre += (faces[i].vertices[0] + faces[i].vertices[1] + faces[i].vertices[2]) / (float)3;
+      }
+      if (!faces.empty()) centre /= (float)faces.size();
+    }
+};
+
+#endif
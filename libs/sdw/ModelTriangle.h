@@ -11,14 +11,12 @@ class ModelTriangle {
     MATERIAL material;
     int faceIndex;   // stores the number of which face it is out of all of them
     int objectIndex; // used in OBJ - stores the group this triangle is in.
-    bool culled; // has this face been culled or not? do we need to check for intersections with it?
 
     ModelTriangle() {
       normals[0] = glm::vec3 (0,0,0);
       normals[1] = glm::vec3 (0,0,0);
       normals[2] = glm::vec3 (0,0,0);
       material = NONE;
-      culled = false;
       faceIndex = -1;
       objectIndex = -1;
     }
@@ -32,11 +30,10 @@ class ModelTriangle {
       normals[1] = glm::vec3 (0,0,0);
       normals[2] = glm::vec3 (0,0,0);
       material = NONE;
-      culled = false;
       faceIndex = -1;
       objectIndex = -1;
     }
-    glm::vec3 getNormal() {
+    glm::vec3 getNormal() const {
       const glm::vec3 e0 = (vertices[1] - vertices[0]); //v1 - v0
       const glm::vec3 e1 = (vertices[2] - vertices[0]); //v2 - v1
       // return the normal = glm::cross(e0, e1); 
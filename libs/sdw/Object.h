@@ -8,49 +8,258 @@
   #include <vector>
 #endif
 
+#include <memory>
+#include <string>
 #include "Materials.h"
+#include <BoundingBox.h>
+#include <TriangleRecord.h>
+#include <Mesh.h>
 
 class Object {
   public:
     std::vector<ModelTriangle> faces; // stores the faces of the object
+    std::string name; // the name of the object's group in the OBJ file
     bool hasBoundingBox; // true if a bounding box has been created for this object
-    std::vector<ModelTriangle> boxFaces; // if a bounding box has been created, this stores the faces of it
+    BoundingBox boundingBox; // if a bounding box has been created, this is the box around all the vertices
     MATERIAL material;
     bool hidden; // Notice::: Implemented for Wireframe & Rasterize ONLY!!!
+    bool castsShadows; // false for the light box, so it doesn't block its own light (raytracer only)
+    bool isLight; // true for the groups the raytracer's lights were made from, which it draws at full brightness
+    unsigned long version; // changes every time the vertices or materials change - two objects only share a version if they have the same faces
+    std::vector<TriangleRecord> triangleRecords; // precomputed intersection data for each face, see UpdateTriangleRecords
+    unsigned long triangleRecordsVersion; // the version triangleRecords was worked out for
+    // an instance shares the faces of mesh instead of having its own (faces is left empty), and transform puts them in
+    // the world - moving an instance only changes transform. the raytracer takes its rays into the mesh's space with
+    // inverseTransform, and the rasterizer moves each vertex into the world with transform
+    std::shared_ptr<const Mesh> mesh;
+    glm::mat4 transform;
+    glm::mat4 inverseTransform;
+    glm::mat3 normalTransform; // the inverse transpose of transform, which keeps normals at right angles to the faces
+    // an instance can't change its mesh's faces, so ApplyColour and ApplyMaterial give it its own colour and material
+    // instead, which are used in place of the faces' ones (see FaceColour and FaceMaterial) - with overridesMaterial,
+    // material is the material of every face
+    bool overridesColour;
+    Colour colourOverride;
+    bool overridesMaterial;
 
     Object() {
       hasBoundingBox = false;
       hidden = false;
+      castsShadows = true;
+      isLight = false;
+      overridesColour = false;
+      overridesMaterial = false;
+      triangleRecordsVersion = 0;
+      SetTransform(glm::mat4(1));
+      MarkChanged();
     }
 
     Object(std::vector<ModelTriangle> inputFaces) {
       faces = inputFaces;
       hasBoundingBox = false;
       hidden = false;
+      castsShadows = true;
+      isLight = false;
+      overridesColour = false;
+      overridesMaterial = false;
+      triangleRecordsVersion = 0;
+      SetTransform(glm::mat4(1));
+      MarkChanged();
+    }
+
+    // an instance of instanceMesh, put in the world by instanceTransform
+    Object(std::shared_ptr<const Mesh> instanceMesh, glm::mat4 instanceTransform) {
+      mesh = instanceMesh;
+      material = NONE;
+      hasBoundingBox = false;
+      hidden = false;
+      castsShadows = true;
+      isLight = false;
+      overridesColour = false;
+      overridesMaterial = false;
+      triangleRecordsVersion = 0;
+      SetTransform(instanceTransform);
+      MarkChanged();
+    }
+
+    bool IsInstance() const {
+      return mesh != nullptr;
+    }
+
+    int FaceCount() const {
+      return IsInstance() ? mesh->faces.size() : faces.size();
+    }
+
+    // face f as it is stored - for an instance the vertices and normals are in the mesh's space, and the colour and
+    // material are the mesh's (FaceColour and FaceMaterial give the ones the instance is drawn with), but the texture
+    // points are the same as the world's
+    const ModelTriangle &LocalFace(int f) const {
+      return IsInstance() ? mesh->faces[f] : faces[f];
+    }
+
+    const Colour &FaceColour(int f) const {
+      return overridesColour ? colourOverride : LocalFace(f).colour;
+    }
+
+    MATERIAL FaceMaterial(int f) const {
+      return overridesMaterial ? material : LocalFace(f).material;
+    }
+
+    // true if face f can only be hit from the front, going by the material it is drawn with (glass is two sided)
+    bool OneSided(int f) const {
+      return FaceMaterial(f) != GLASS;
+    }
+
+    // true if the one sided flags in Records() can be used to cull back faces - they come from the mesh's own
+    // materials, so an instance that overrides the material has to check OneSided for each face it hits instead
+    bool CullsWithRecords() const {
+      return !overridesMaterial;
+    }
+
+    // false if a ray going in direction (in the same space as LocalFace) hits the back of a one sided face f
+    bool FacesRay(int f, glm::vec3 direction) const {
+      return !OneSided(f) || (glm::dot(direction, Records()[f].normal) < 0);
+    }
+
+    // the precomputed intersection data, in the same space as LocalFace
+    const std::vector<TriangleRecord> &Records() const {
+      return IsInstance() ? mesh->triangleRecords : triangleRecords;
+    }
+
+    glm::vec3 WorldVertex(int f, int v) const {
+      if (!IsInstance()) return faces[f].vertices[v];
+      return glm::vec3(transform * glm::vec4(mesh->faces[f].vertices[v], 1));
+    }
+
+    // face f with its vertices and normals in the world, and the colour and material it is drawn with
+    ModelTriangle WorldFace(int f) const {
+      if (!IsInstance()) return faces[f];
+      ModelTriangle face = mesh->faces[f];
+      for (int v = 0; v < 3; v++) {
+        face.vertices[v] = glm::vec3(transform * glm::vec4(face.vertices[v], 1));
+        face.normals[v] = normalTransform * face.normals[v];
+      }
+      face.colour = FaceColour(f);
+      face.material = FaceMaterial(f);
+      return face;
+    }
+
+    // the normalised normal of face f in the world
+    glm::vec3 WorldFaceNormal(int f) const {
+      if (!IsInstance()) return triangleRecords[f].normal;
+      return glm::normalize(normalTransform * mesh->triangleRecords[f].normal);
+    }
+
+    void SetTransform(glm::mat4 newTransform) {
+      transform = newTransform;
+      inverseTransform = glm::inverse(transform);
+      normalTransform = glm::transpose(glm::inverse(glm::mat3(transform)));
+    }
+
+    // moves an instance by matrix, after whatever transform it already has
+    void Transform(glm::mat4 matrix) {
+      SetTransform(matrix * transform);
+      MarkChanged();
+    }
+
+    static glm::mat4 Translation(glm::vec3 offset) {
+      glm::mat4 matrix(1);
+      matrix[3] = glm::vec4(offset, 1);
+      return matrix;
+    }
+
+    static glm::mat4 Scaling(glm::vec3 scale) {
+      return glm::mat4(glm::mat3(scale.x, 0, 0, 0, scale.y, 0, 0, 0, scale.z));
+    }
+
+    // matrix done about point instead of the origin
+    static glm::mat4 AboutPoint(glm::mat4 matrix, glm::vec3 point) {
+      return Translation(point) * matrix * Translation(-point);
+    }
+
+    // every change gets a version number that has never been used before, so the raytracer can tell an object
+    // has moved even if it has been overwritten with an older copy of itself (like the animations do)
+    static unsigned long NewVersion() {
+      static unsigned long lastVersion = 0;
+      return ++lastVersion;
+    }
+
+    // call this after changing the vertices or materials of any face directly - it also updates the bounding box
+    void MarkChanged() {
+      version = NewVersion();
+      UpdateBoundingBox();
+    }
+
+    void UpdateBoundingBox() {
+      boundingBox = BoundingBox();
+      // the box around the corners of the mesh's box, which is a little bigger than the box around the moved faces
+      if (IsInstance() && !mesh->boundingBox.IsEmpty()) {
+        const BoundingBox &meshBox = mesh->boundingBox;
+        for (int c = 0; c < 8; c++) {
+          const glm::vec3 corner((c & 1) ? meshBox.max.x : meshBox.min.x, (c & 2) ? meshBox.max.y : meshBox.min.y, (c & 4) ? meshBox.max.z : meshBox.min.z);
+          boundingBox.Expand(glm::vec3(transform * glm::vec4(corner, 1)));
+        }
+      }
+      for (int i = 0; i < (int)faces.size(); i++) {
+        boundingBox.Expand(faces[i].vertices[0]);
+        boundingBox.Expand(faces[i].vertices[1]);
+        boundingBox.Expand(faces[i].vertices[2]);
+      }
+      hasBoundingBox = true;
+    }
+
+    // the raytracer calls this before each frame - moving the object makes the records out of date, but they are only
+    // worked out again here, so an object that is transformed several times between frames only pays for it once
+    // returns false if the records were already up to date (which they always are for an instance, as they are its mesh's)
+    bool UpdateTriangleRecords() {
+      if (IsInstance() || (triangleRecordsVersion == version)) return false;
+      triangleRecords.resize(faces.size());
+      for (int i = 0; i < (int)faces.size(); i++) triangleRecords[i] = TriangleRecord(faces[i]);
+      triangleRecordsVersion = version;
+      return true;
     }
 
     void Clear() {
       faces.clear();
-      hasBoundingBox = false;
-      boxFaces.clear();
+      mesh.reset();
+      overridesColour = false;
+      overridesMaterial = false;
+      SetTransform(glm::mat4(1));
+      MarkChanged();
     }
 
     void ApplyMaterial(MATERIAL mat) {
+      if (IsInstance()) overridesMaterial = true;
       for(int i= 0; i< faces.size(); i++) {
         faces.at(i).material = mat;
       }
       material = mat;
+      // glass is two sided, so the triangle records depend on the material
+      MarkChanged();
     }
 
     void ApplyColour(Colour colour, bool resetMaterial) {
+      if (IsInstance()) {
+        overridesColour = true;
+        colourOverride = colour;
+        if (resetMaterial) {
+          overridesMaterial = true;
+          material = NONE;
+        }
+        MarkChanged();
+        return;
+      }
       for(int i= 0; i< faces.size(); i++) {
         faces.at(i).colour = colour;
         if (resetMaterial) faces.at(i).material = NONE;
         material = NONE;
       }
+      // the colours are read when shading, so the raytracer has to redraw the object even if no material changed
+      MarkChanged();
     }
 
     glm::vec3 GetCentre() {
+      if (IsInstance()) return glm::vec3(transform * glm::vec4(mesh->centre, 1));
       glm::vec3 sum(0,0,0);
       for (int i=0; i< faces.size(); i++) {
         sum += ((faces.at(i).vertices[0] + faces.at(i).vertices[1] + faces.at(i).vertices[2])/(float)3);
@@ -74,12 +283,14 @@ class Object {
       glm::mat3 rotationMatrix (col1, col2, col3);
       
       const glm::vec3 centre = GetCentre();
+      if (IsInstance()) return Transform(AboutPoint(glm::mat4(rotationMatrix), centre));
 
       for (int i=0; i<faces.size(); i++) {
         faces.at(i).vertices[0] = centre + rotationMatrix * (faces.at(i).vertices[0] - centre);
         faces.at(i).vertices[1] = centre + rotationMatrix * (faces.at(i).vertices[1] - centre);
         faces.at(i).vertices[2] = centre + rotationMatrix * (faces.at(i).vertices[2] - centre);
       }
+      MarkChanged();
     }
     // Rotate about the point in the XZ direction.
     void RotateXZ(float theta, glm::vec3 point) {
@@ -87,12 +298,14 @@ class Object {
       glm::vec3 col2 = glm::vec3 (0, 1, 0); 
       glm::vec3 col3 = glm::vec3 (sin(theta), 0, cos(theta));
       glm::mat3 rotationMatrix (col1, col2, col3);
+      if (IsInstance()) return Transform(AboutPoint(glm::mat4(rotationMatrix), point));
       
       for (int i=0; i<faces.size(); i++) {
         faces.at(i).vertices[0] = point + rotationMatrix * (faces.at(i).vertices[0] - point);
         faces.at(i).vertices[1] = point + rotationMatrix * (faces.at(i).vertices[1] - point);
         faces.at(i).vertices[2] = point + rotationMatrix * (faces.at(i).vertices[2] - point);
       }
+      MarkChanged();
     }
     // Rotate about the centre in the ZY direction.
     void RotateZY(float theta) {
@@ -102,12 +315,14 @@ class Object {
       glm::mat3 rotationMatrix (col1, col2, col3);
       
       const glm::vec3 centre = GetCentre();
+      if (IsInstance()) return Transform(AboutPoint(glm::mat4(rotationMatrix), centre));
 
       for (int i=0; i<faces.size(); i++) {
         faces.at(i).vertices[0] = centre + rotationMatrix * (faces.at(i).vertices[0] - centre);
         faces.at(i).vertices[1] = centre + rotationMatrix * (faces.at(i).vertices[1] - centre);
         faces.at(i).vertices[2] = centre + rotationMatrix * (faces.at(i).vertices[2] - centre);
       }
+      MarkChanged();
     }
     // Rotate about the centre in the YX direction.
     void RotateYX(float theta) {
@@ -117,29 +332,33 @@ class Object {
       glm::mat3 rotationMatrix (col1, col2, col3);
       
       const glm::vec3 centre = GetCentre();
+      if (IsInstance()) return Transform(AboutPoint(glm::mat4(rotationMatrix), centre));
 
       for (int i=0; i<faces.size(); i++) {
         faces.at(i).vertices[0] = centre + rotationMatrix * (faces.at(i).vertices[0] - centre);
         faces.at(i).vertices[1] = centre + rotationMatrix * (faces.at(i).vertices[1] - centre);
         faces.at(i).vertices[2] = centre + rotationMatrix * (faces.at(i).vertices[2] - centre);
       }
+      MarkChanged();
     }
     // Move d distance in normalised direction.
     void Move(glm::vec3 direction, float distance) {
       direction = normalize(direction);
+      if (IsInstance()) return Transform(Translation(distance * direction));
       for (int i = 0; i < faces.size(); i++){
         faces[i].vertices[0] += (distance * direction);
         faces[i].vertices[1] += (distance * direction);
         faces[i].vertices[2] += (distance * direction);
       }
+      MarkChanged();
     }
 
     float getLowestYValue() {
       float minY = std::numeric_limits<float>::infinity();
       // go through each vertex to find the minimum Y value.
-      for (int i = 0; i < faces.size(); i++) {
+      for (int i = 0; i < FaceCount(); i++) {
         for (int j = 0; j < 3; j++) {
-          const float tempY = faces.at(i).vertices[j].y;
+          const float tempY = WorldVertex(i, j).y;
           if (tempY < minY) minY = tempY;
         }
       }
@@ -149,24 +368,29 @@ class Object {
     // Snap To Floor - move object down or up so the lowest vertex is at Y=0.
     void SnapToY0() {
       const float minY = getLowestYValue();
+      if (IsInstance()) return Transform(Translation(glm::vec3(0, -minY, 0)));
       // go through each vertex and move up by - minY.
       for (int i = 0; i < faces.size(); i++) {
         for (int j = 0; j< 3; j++) {
           faces.at(i).vertices[j] += glm::vec3(0, -minY, 0);
         }
       }
+      MarkChanged();
     }
 
     void Scale(glm::vec3 scale) {
       glm::vec3 centre = GetCentre();
+      if (IsInstance()) return Transform(AboutPoint(Scaling(scale), centre));
       for (int i = 0; i < faces.size(); i++) {
         faces[i].vertices[0] = centre + (scale * (faces[i].vertices[0] - centre));
         faces[i].vertices[1] = centre + (scale * (faces[i].vertices[1] - centre));
         faces[i].vertices[2] = centre + (scale * (faces[i].vertices[2] - centre));
       }
+      MarkChanged();
     }
     
     void ScaleObject(glm::vec3 point, float scaleFactor) {
+      if (IsInstance()) return Transform(AboutPoint(Scaling(glm::vec3(1 - scaleFactor)), point));
       for (int i = 0; i < faces.size(); i++){
         for (int j = 0; j < 3; j++){
           glm::vec3 pointToVertex = faces[i].vertices[j] - point;
@@ -175,6 +399,7 @@ class Object {
           faces[i].vertices[j] = newPoint;
         }
       }
+      MarkChanged();
     }
 
     void Scale_Locked_YMin(glm::vec3 scale) {      
@@ -183,9 +408,9 @@ class Object {
       int i_vertexY = -1;
 
       // go through each vertex to find the minimum Y value.
-      for (int i = 0; i < faces.size(); i++) {
+      for (int i = 0; i < FaceCount(); i++) {
         for (int j = 0; j < 3; j++) {
-          const float tempY = faces.at(i).vertices[j].y;
+          const float tempY = WorldVertex(i, j).y;
           if (tempY < minY) {
             minY = tempY;
             i_faceY = i;
@@ -196,8 +421,9 @@ class Object {
 
       Scale(scale);
 
-      const float scaledMinY = faces[i_faceY].vertices[i_vertexY][1]; // This is our current lowest Y value.
+      const float scaledMinY = WorldVertex(i_faceY, i_vertexY)[1]; // This is our current lowest Y value.
       const float distToMoveDown = scaledMinY - minY;
+      if (IsInstance()) return Transform(Translation(glm::vec3(0, -distToMoveDown, 0)));
       
       // go through each vertex and move up by - minY.
       for (int i = 0; i < faces.size(); i++) {
@@ -205,6 +431,7 @@ class Object {
           faces.at(i).vertices[j] += glm::vec3(0, -distToMoveDown, 0);
         }
       }
+      MarkChanged();
       
     }
 
@@ -215,14 +442,14 @@ class Object {
       float lowestPoint = std::numeric_limits<float>::infinity();
       glm::vec3 averagedVertices (0,0,0);
 
-      for (int i = 0; i < faces.size(); i++){
+      for (int i = 0; i < FaceCount(); i++){
         for (int j = 0 ; j < 3 ; j++){
-          glm::vec3 vertex = faces[i].vertices[j];
+          glm::vec3 vertex = WorldVertex(i, j);
           averagedVertices += vertex;
           if (vertex[1] < lowestPoint) lowestPoint = vertex[1];
         }
       }
-      averagedVertices /= float(faces.size() * 3);
+      averagedVertices /= float(FaceCount() * 3);
 
       // we squash the object around the following point (the centre but on the under side of the object)
       glm::vec3 squashCentre = averagedVertices;
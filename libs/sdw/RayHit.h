@@ -0,0 +1,27 @@
+#ifndef RAYHIT_H
+#define RAYHIT_H
+
+// a compact record of where a ray hit the scene - just indices and numbers, so it can be passed around and
+// copied for free (the triangle itself is looked up with objects[objectIndex].LocalFace(faceIndex) when it is needed)
+class RayHit {
+  public:
+    int objectIndex; // -1 if the ray hit nothing
+    int faceIndex;
+    float t; // distance along the ray
+    float u; // local coordinates - the hit point is v0 + u*(v1 - v0) + v*(v2 - v0)
+    float v;
+
+    RayHit() {
+      objectIndex = -1;
+      faceIndex = -1;
+      t = -1;
+      u = 0;
+      v = 0;
+    }
+
+    bool IsHit() const {
+      return objectIndex != -1;
+    }
+};
+
+#endif
@@ -1,31 +1,22 @@
 #include <glm/glm.hpp>
-#include <iostream>
 
+// everything the shading needs to know about where a ray hit - like RayHit it only holds indices and numbers, so it is
+// cheap to copy, and the triangle's colour, material and texture points are looked up with hitTriangle when needed
 class RayTriangleIntersection
 {
   public:
+    int objectIndex;
+    int faceIndex;
     glm::vec3 intersectionPoint;
-    glm::vec2 intersectUV;
-    float distanceFromCamera;
-    ModelTriangle intersectedTriangle;
-    glm::vec3 normal;
+    glm::vec2 intersectUV; // the u and v of the hit, see RayHit
+    float distanceFromCamera; // distance along the ray, or -1 if it hit nothing
+    glm::vec3 normal; // the interpolated vertex normal, for Phong shading
+    glm::vec3 faceNormal; // the triangle's own normal, from its TriangleRecord
 
     RayTriangleIntersection()
     {
-    }
-
-    RayTriangleIntersection(glm::vec3 point, float distance, ModelTriangle triangle)
-    {
-        intersectionPoint = point;
-        distanceFromCamera = distance;
-        intersectedTriangle = triangle;
+        objectIndex = -1;
+        faceIndex = -1;
+        distanceFromCamera = -1;
     }
 };
-
-/*
-std::ostream& operator<<(std::ostream& os, const RayTriangleIntersection& intersection)
-{
-    os << "Intersection is at " << intersection.intersectionPoint << " on triangle " << intersection.intersectedTriangle << " at a distance of " << intersection.distanceFromCamera << std::endl;
-    return os;
-}
-*/
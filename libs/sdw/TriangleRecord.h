@@ -0,0 +1,58 @@
+#ifndef TRIANGLERECORD_H
+#define TRIANGLERECORD_H
+
+#include <glm/glm.hpp>
+
+#ifndef MODELTRIANGLE_H
+  #define MODELTRIANGLE_H
+  #include <ModelTriangle.h>
+#endif
+
+// everything the ray-triangle test needs, worked out once per triangle instead of once per ray
+// the test is Moller-Trumbore, which gives the same (t,u,v) as inverting the (-ray, e0, e1) matrix from the worksheet
+class TriangleRecord {
+  public:
+    glm::vec3 v0;
+    glm::vec3 e0; // v1 - v0
+    glm::vec3 e1; // v2 - v0
+    glm::vec3 normal; // normalised cross(e0, e1), the same as ModelTriangle::getNormal() - the shading uses this too
+    bool oneSided; // false for glass, which rays can hit from behind
+
+    TriangleRecord() {
+      oneSided = true;
+    }
+
+    TriangleRecord(const ModelTriangle &triangle) {
+      v0 = triangle.vertices[0];
+      e0 = triangle.vertices[1] - triangle.vertices[0];
+      e1 = triangle.vertices[2] - triangle.vertices[0];
+      normal = glm::normalize(glm::cross(e0, e1));
+      oneSided = (triangle.material != GLASS);
+    }
+
+    // returns true if the ray hits the triangle inside (tMin, tMax), storing the distance along the ray in t and the
+    // local coordinates in u and v (the hit point is v0 + u*e0 + v*e1)
+    // with cullBackFaces a one sided triangle is only hit from the front (the side its normal points to)
+    bool Intersect(glm::vec3 origin, glm::vec3 direction, float tMin, float tMax, bool cullBackFaces, float &t, float &u, float &v) const {
+      const glm::vec3 p = glm::cross(direction, e1);
+      const float determinant = glm::dot(e0, p);
+      // the ray is parallel to the triangle
+      if (std::abs(determinant) < 1e-12f) return false;
+      // the determinant is -dot(direction, cross(e0, e1)), so it is negative when the ray hits the back of the triangle
+      if (cullBackFaces && oneSided && (determinant < 0)) return false;
+      const float inverseDeterminant = 1 / determinant;
+
+      const glm::vec3 s = origin - v0;
+      u = glm::dot(s, p) * inverseDeterminant;
+      if ((u < 0) || (u > 1)) return false;
+
+      const glm::vec3 q = glm::cross(s, e0);
+      v = glm::dot(direction, q) * inverseDeterminant;
+      if ((v < 0) || ((u + v) > 1)) return false;
+
+      t = glm::dot(e1, q) * inverseDeterminant;
+      return (t > tMin) && (t < tMax);
+    }
+};
+
+#endif